@@ -0,0 +1,682 @@
+/*
+ * fcbench drives the caching core with random reads from a number of
+ * threads, against a mock origin and cache, and prints one CSV line per
+ * combination of block size, I/O size, thread count and initial residency.
+ * With several targets on the same origin, threads are spread over them,
+ * and those of the same rank on each target read the same blocks.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <getopt.h>
+#include "../dm-foolcache.h"
+#include "mock.h"
+
+enum bench_mode {
+	BENCH_PLAIN,
+	BENCH_RECORD,			// with the access trace recorded
+	BENCH_PREWARM,			// prewarmed with the trace of a first pass
+};
+
+#define MAX_TARGETS 64
+
+struct bench {
+	u64 size;			// bytes
+	unsigned int duration;		// ms per configuration
+	unsigned int readahead;
+	unsigned int subblock;		// KB, 0 for none
+	unsigned int partial_blocks;	// kept at most, 0 for the default
+	unsigned int fail_every;	// request of the caches, 0 for none
+	int error_threshold;		// -1 for the default
+	unsigned int mode;
+	unsigned int targets;		// on the same origin
+	bool shared;
+	u64 bad_reads;			// returning other data than origin's
+	u64 failed_reads;		// returning an error
+	struct block_device origin, meta, caches[MAX_TARGETS];
+	struct dm_dev origin_dev, meta_dev, cache_devs[MAX_TARGETS];
+};
+
+struct bench_thread {
+	struct bench* b;
+	struct foolcache_c* fcc;
+	pthread_t thread;
+	unsigned int io_sectors;
+	u64 seed;
+	sem_t done;
+	int error;
+	u32* lat;			// us
+	size_t ios, cap;
+	char* buf;			// read into
+	volatile int* stop;
+};
+
+static struct foolcache_c* bench_ctor(struct bench* b, unsigned int target,
+	unsigned int block_kb, unsigned int residency, bool record)
+{
+	unsigned long block;
+	unsigned int bs = block_kb * (1024/512);
+	u64 seed = 88172645463325252ULL;
+	struct foolcache_c* fcc = calloc(1, sizeof(*fcc));
+	if (fcc == NULL) return NULL;
+
+	fcc->origin = &b->origin_dev;
+	fcc->cache = &b->cache_devs[target];
+	fcc->meta = &b->meta_dev;
+	fcc->size = b->size;
+	fcc->sectors = b->size >> SECTOR_SHIFT;
+	fcc->blocks = DIV_ROUND_UP(fcc->sectors, bs);
+	fcc->block_size = bs;
+	fcc->block_shift = __builtin_ctz(bs);
+	fcc->block_mask = ~(bs-1);
+	if (b->subblock && b->subblock < block_kb)
+	{
+		fcc->subblock_shift = __builtin_ctz(b->subblock * (1024/512));
+		fcc->subblocks = block_kb / b->subblock;
+	}
+	fcc->bitmap_sectors = DIV_ROUND_UP(fcc->blocks, 8*512);
+	fcc->header_sector = 0;
+	fcc->bitmap_sector = 1;
+	fcc->last_caching_sector = fcc->sectors - 1;
+	fcc->bitmap = calloc(fcc->bitmap_sectors, 512);
+	fcc->copying = calloc(fcc->bitmap_sectors, 512);
+	fcc->region_gen = calloc(DIV_ROUND_UP(fcc->blocks, FOOLCACHE_REGION_BLOCKS), sizeof(u64));
+	fcc->stats = alloc_percpu(struct fc_stats);
+	fcc->io_pool = mempool_create_kmalloc_pool(16, sizeof(struct fc_io));
+	if (fcc->bitmap == NULL || fcc->copying == NULL || fcc->region_gen == NULL ||
+		fcc->stats == NULL || fcc->io_pool == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	if (fc_core_init(fcc))
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	fcc->readahead = b->readahead;
+	if (b->partial_blocks) fcc->max_partial_blocks = b->partial_blocks;
+	if (b->error_threshold >= 0) fcc->error_threshold = b->error_threshold;
+	atomic64_set(&fcc->cached_blocks, 0);
+	mock_device_store(fcc->cache->bdev, fcc->sectors);
+	for (block=0; block<fcc->blocks; ++block)
+	{
+		seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+		if (seed % 100 < residency)
+		{
+			set_bit(block, fcc->bitmap);
+			atomic64_inc(&fcc->cached_blocks);
+			mock_device_fill(fcc->cache->bdev, (sector_t)block * bs,
+				min_t(sector_t, bs, fcc->sectors - (sector_t)block * bs));
+		}
+	}
+	fcc->bitmap_last_sync = jiffies;
+
+	if (record)
+	{
+		fcc->trace_cap = min_t(unsigned long, fcc->blocks, FC_TRACE_MAX_BLOCKS);
+		fcc->trace = calloc(fcc->trace_cap, sizeof(u32));
+		fcc->accessed = calloc(fcc->bitmap_sectors, 512);
+		if (fcc->trace == NULL || fcc->accessed == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		fcc->recording = 1;
+	}
+	if (b->shared && (fcc->shared = fc_shared_get(fcc->origin->bdev)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return fcc;
+}
+
+// whether the cache holds the origin data of sectors [sector, sector+count)
+static int check_cached(struct foolcache_c* fcc, sector_t sector, sector_t count)
+{
+	sector_t bad;
+	count = min_t(sector_t, count, fcc->sectors - sector);
+	bad = mock_device_check(fcc->cache->bdev, sector, count);
+	if (bad == sector + count) return 0;
+	fprintf(stderr, "sector %llu of block %lu cached with other data\n",
+		(unsigned long long)bad, sector2block(fcc, bad));
+	return -1;
+}
+
+/*
+ * The core must be left idle and consistent once every bio has completed,
+ * with the origin data in every block, and sub-block, it has as cached.
+ */
+static int bench_check(struct foolcache_c* fcc)
+{
+	int r = 0;
+	unsigned long i, j, partial, cached = 0;
+	unsigned long words = fcc->bitmap_sectors * 512 / sizeof(long);
+	for_each_set_bit(i, fcc->bitmap, fcc->blocks)
+	{
+		if (check_cached(fcc, block2sector(fcc, i), fcc->block_size))
+		{
+			r = -1;
+			break;
+		}
+	}
+	for (i=0; i<words; ++i)
+	{
+		cached += __builtin_popcountl(fcc->bitmap[i]);
+		if (fcc->copying[i])
+		{
+			fprintf(stderr, "block %lu left copying\n",
+				i * BITS_PER_LONG + __builtin_ctzl(fcc->copying[i]));
+			r = -1;
+		}
+	}
+	if (cached != atomic64_read(&fcc->cached_blocks))
+	{
+		fprintf(stderr, "cached_blocks %lld, bitmap %lu\n",
+			(long long)atomic64_read(&fcc->cached_blocks), cached);
+		r = -1;
+	}
+	for (i=partial=0; i<(1<<FC_PARTIAL_HASH_BITS); ++i)
+	{
+		struct fc_partial* p;
+		list_for_each_entry(p, &fcc->partial_hash[i], list)
+		{
+			partial++;
+			if (test_bit(p->block, fcc->bitmap))
+			{
+				fprintf(stderr, "block %lu cached and partial\n", p->block);
+				r = -1;
+			}
+			for_each_set_bit(j, p->bits, fcc->subblocks)
+			{
+				if (check_cached(fcc, block2sector(fcc, p->block) + 
+						(j << fcc->subblock_shift), 1 << fcc->subblock_shift))
+					r = -1;
+			}
+		}
+	}
+	if (partial != fcc->partial_blocks || partial > fcc->max_partial_blocks)
+	{
+		fprintf(stderr, "%lu partial blocks, %u counted, at most %u\n",
+			partial, fcc->partial_blocks, fcc->max_partial_blocks);
+		r = -1;
+	}
+	for (i=0; i<(1<<FC_ERROR_HASH_BITS); ++i)
+	{
+		struct fc_error* e;
+		list_for_each_entry(e, &fcc->error_hash[i], list)
+		{
+			if (test_bit(e->block, fcc->bitmap))
+			{
+				fprintf(stderr, "block %lu cached and backing off\n", e->block);
+				r = -1;
+			}
+		}
+	}
+	if (fcc->error_threshold && fcc->window_errors >= fcc->error_threshold &&
+		!fcc->bypassing)
+	{
+		fprintf(stderr, "%u errors without bypassing\n", fcc->window_errors);
+		r = -1;
+	}
+	if (atomic_read(&fcc->kcopyd_jobs) || fcc->sched.inflight)
+	{
+		fprintf(stderr, "copies left in flight\n");
+		r = -1;
+	}
+	return r;
+}
+
+static void bench_dtor(struct foolcache_c* fcc)
+{
+	wait_bitmap(fcc);
+	fc_core_exit(fcc);
+	if (fcc->shared) fc_shared_put(fcc->shared);
+	free(fcc->bitmap);
+	free(fcc->copying);
+	free(fcc->region_gen);
+	free(fcc->trace);
+	free(fcc->accessed);
+	free_percpu(fcc->stats);
+	mempool_destroy(fcc->io_pool);
+	free(fcc);
+}
+
+static void bench_endio(struct bio* bio, int error)
+{
+	struct bench_thread* t = bio->bi_private;
+	t->error = error;
+	sem_post(&t->done);
+}
+
+static void* bench_thread(void* arg)
+{
+	struct bench_thread* t = arg;
+	struct foolcache_c* fcc = t->fcc;
+	u64 ios = fcc->sectors / t->io_sectors;
+	union map_info map_context;
+	struct bio bio;
+	struct bio_vec bvec;
+	sector_t sector, i;
+	u64 tag;
+	ktime_t start;
+	int r;
+
+	t->buf = malloc(t->io_sectors * 512);
+	if (t->buf == NULL) abort();
+	while (!*t->stop)
+	{
+		t->seed ^= t->seed << 13; t->seed ^= t->seed >> 7; t->seed ^= t->seed << 17;
+		sector = (t->seed % ios) * t->io_sectors;
+		for (i=0; i<t->io_sectors; ++i)
+		{
+			memset(t->buf + i * 512, 0, sizeof(tag));
+		}
+		bvec.bv_page = t->buf;
+		bvec.bv_len = t->io_sectors * 512;
+		bvec.bv_offset = 0;
+		memset(&bio, 0, sizeof(bio));
+		bio.bi_sector = sector;
+		bio.bi_size = t->io_sectors * 512;
+		bio.bi_io_vec = &bvec;
+		bio.bi_rw = READ;
+		bio.bi_end_io = bench_endio;
+		bio.bi_private = t;
+
+		start = ktime_get();
+		map_context.ptr = NULL;
+		r = map_async(fcc, &bio, &map_context);
+		if (r < 0)
+		{
+			fprintf(stderr, "map failed: %d\n", r);
+			break;
+		}
+		if (r == DM_MAPIO_REMAPPED) mock_submit_bio(&bio);
+		do {
+			sem_wait(&t->done);
+		} while ((r = fc_end_io(fcc, map_context.ptr, t->error)) == DM_ENDIO_INCOMPLETE);
+		if (r) __sync_fetch_and_add(&t->b->failed_reads, 1);
+		for (i=0; i<t->io_sectors && !t->error; ++i)
+		{	// whether from origin or cache, the data must be origin's
+			memcpy(&tag, t->buf + i * 512, sizeof(tag));
+			if (tag == sector + i + 1) continue;
+			if (__sync_fetch_and_add(&t->b->bad_reads, 1) == 0)
+				fprintf(stderr, "sector %llu read as %lld\n",
+					(unsigned long long)(sector + i), (long long)tag - 1);
+			break;
+		}
+
+		if (t->ios == t->cap)
+		{
+			t->cap = t->cap ? t->cap * 2 : 4096;
+			t->lat = realloc(t->lat, t->cap * sizeof(u32));
+			if (t->lat == NULL) abort();
+		}
+		t->lat[t->ios++] = ktime_to_us(ktime_sub(ktime_get(), start));
+	}
+	free(t->buf);
+	return NULL;
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+	u32 x = *(const u32*)a, y = *(const u32*)b;
+	return x < y ? -1 : x > y;
+}
+
+static u32 percentile(u32* lat, size_t n, unsigned int permille)
+{
+	if (n == 0) return 0;
+	return lat[min_t(size_t, n * permille / 1000, n - 1)];
+}
+
+// read for b->duration, returns the sorted latencies of all the reads
+static size_t run_threads(struct bench* b, struct foolcache_c** fccs,
+	unsigned int targets, unsigned int io_kb, unsigned int threads, 
+	u32** latp, ktime_t* elapsed)
+{
+	unsigned int i;
+	size_t n = 0;
+	u32* lat;
+	ktime_t start;
+	volatile int stop = 0;
+	struct bench_thread* t = calloc(threads, sizeof(*t));
+	if (t == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	start = ktime_get();
+	for (i=0; i<threads; ++i)
+	{
+		t[i].b = b;
+		t[i].fcc = fccs[i % targets];
+		t[i].io_sectors = io_kb * (1024/512);
+		t[i].seed = 0x9e3779b97f4a7c15ULL * (i / targets + 1);
+		t[i].stop = &stop;
+		sem_init(&t[i].done, 0, 0);
+		pthread_create(&t[i].thread, NULL, bench_thread, &t[i]);
+	}
+	usleep(b->duration * 1000);
+	stop = 1;
+	for (i=0; i<threads; ++i)
+	{
+		pthread_join(t[i].thread, NULL);
+		n += t[i].ios;
+	}
+	*elapsed = ktime_sub(ktime_get(), start);
+
+	lat = malloc(max_t(size_t, n, 1) * sizeof(u32));
+	for (i=0, n=0; i<threads; ++i)
+	{
+		memcpy(lat + n, t[i].lat, t[i].ios * sizeof(u32));
+		n += t[i].ios;
+		free(t[i].lat);
+		sem_destroy(&t[i].done);
+	}
+	qsort(lat, n, sizeof(u32), cmp_u32);
+	free(t);
+	*latp = lat;
+	return n;
+}
+
+// the trace of a first pass over a cache of the same residency
+static u32* record_trace(struct bench* b, unsigned int block_kb,
+	unsigned int io_kb, unsigned int threads, unsigned int residency,
+	unsigned long* count)
+{
+	u32 *lat, *trace;
+	ktime_t elapsed;
+	struct foolcache_c* fcc = bench_ctor(b, 0, block_kb, residency, true);
+	run_threads(b, &fcc, 1, io_kb, threads, &lat, &elapsed);
+	fc_sched_quiesce(fcc);
+	*count = min_t(unsigned long, atomic_read(&fcc->trace_len), fcc->trace_cap);
+	trace = malloc(max_t(unsigned long, *count, 1) * sizeof(u32));
+	if (trace == NULL) abort();
+	memcpy(trace, fcc->trace, *count * sizeof(u32));
+	bench_dtor(fcc);
+	free(lat);
+	return trace;
+}
+
+// whether the block failed to copy, and is left to a later retry
+static bool copy_failed(struct foolcache_c* fcc, unsigned long block)
+{
+	struct fc_error* e;
+	list_for_each_entry(e, &fcc->error_hash[hash_long(block, FC_ERROR_HASH_BITS)], list)
+	{
+		if (e->block == block) return true;
+	}
+	return false;
+}
+
+/*
+ * The replay goes on over a suspend, and leaves every block of it cached,
+ * but those that failed to copy; the bypass mode stops it for good.
+ */
+static int check_prewarm(struct foolcache_c* fcc, u32* trace, unsigned long count)
+{
+	unsigned long i;
+	u64 done = 0;
+	ktime_t progress = ktime_get();
+	while (atomic64_read(&fcc->prewarm_done) < atomic64_read(&fcc->prewarm_total))
+	{
+		if (fcc->bypassing) break;
+		if (atomic64_read(&fcc->prewarm_done) != done)
+		{
+			done = atomic64_read(&fcc->prewarm_done);
+			progress = ktime_get();
+		}
+		if (ktime_to_us(ktime_sub(ktime_get(), progress)) > 10*1000*1000)
+		{
+			fprintf(stderr, "prewarm stopped at %llu/%llu\n",
+				(unsigned long long)done, 
+				(unsigned long long)atomic64_read(&fcc->prewarm_total));
+			return -1;
+		}
+		msleep(10);
+	}
+	fc_sched_quiesce(fcc);
+	for (i=0; i<count && !fcc->bypassing; ++i)
+	{
+		if (trace[i] <= last_caching_block(fcc) && !test_bit(trace[i], fcc->bitmap) &&
+			!copy_failed(fcc, trace[i]))
+		{
+			fprintf(stderr, "block %u prewarmed but not cached\n", trace[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int run(struct bench* b, unsigned int block_kb, unsigned int io_kb,
+	unsigned int threads, unsigned int residency)
+{
+	int r = 0;
+	size_t n;
+	u32* lat;
+	u32 *trace = NULL, *replayed = NULL;
+	unsigned long count = 0;
+	unsigned int i;
+	long long hits = 0, misses = 0;
+	u64 copied = 0;
+	ktime_t elapsed;
+	struct foolcache_c* fccs[MAX_TARGETS];
+
+	if (b->mode == BENCH_PREWARM)
+	{
+		trace = record_trace(b, block_kb, io_kb, threads, residency, &count);
+	}
+	for (i=0; i<b->targets; ++i)
+	{
+		fccs[i] = bench_ctor(b, i, block_kb, residency, b->mode == BENCH_RECORD);
+	}
+	if (trace)
+	{	// replayed while the measured pass reads, and over a suspend
+		replayed = malloc(max_t(unsigned long, count, 1) * sizeof(u32));
+		if (replayed == NULL) abort();
+		memcpy(replayed, trace, count * sizeof(u32));
+		prewarm_blocks(fccs[0], trace, count);
+		fc_sched_quiesce(fccs[0]);
+		fc_sched_resume(fccs[0]);
+	}
+	b->origin.bytes = 0;
+	b->bad_reads = 0;
+	b->failed_reads = 0;
+	n = run_threads(b, fccs, b->targets, io_kb, threads, &lat, &elapsed);
+	for (i=0; i<b->targets; ++i)
+	{
+		hits += atomic64_read(&fccs[i]->hits);
+		misses += atomic64_read(&fccs[i]->misses);
+		copied += fccs[i]->stats->bytes_copied;
+	}
+
+	printf("%u,%u,%u,%u,%zu,%.0f,%.1f,%u,%u,%u,%u,%lld,%lld,%llu,%llu\n",
+		block_kb, io_kb, threads, residency, n,
+		n * 1e9 / elapsed, n * io_kb / 1024.0 * 1e9 / elapsed,
+		percentile(lat, n, 500), percentile(lat, n, 990),
+		percentile(lat, n, 999), n ? lat[n-1] : 0, hits, misses,
+		(unsigned long long)(copied >> 20),
+		(unsigned long long)(b->origin.bytes >> 20));
+	fflush(stdout);
+
+	if (b->failed_reads)
+	{	// only the caches fail, reads are served from origin then
+		fprintf(stderr, "%llu reads failed\n", (unsigned long long)b->failed_reads);
+		r = -1;
+	}
+	if (b->bad_reads)
+	{
+		fprintf(stderr, "%llu reads returned other data than origin's\n",
+			(unsigned long long)b->bad_reads);
+		r = -1;
+	}
+	if (replayed && check_prewarm(fccs[0], replayed, count)) r = -1;
+	for (i=0; i<b->targets; ++i)
+	{
+		fc_sched_quiesce(fccs[i]);
+		if (bench_check(fccs[i])) r = -1;
+	}
+	for (i=0; i<b->targets; ++i)
+	{
+		bench_dtor(fccs[i]);
+	}
+	free(replayed);
+	free(lat);
+	return r;
+}
+
+static int parse_list(const char* s, unsigned int* list, int max)
+{
+	int n = 0;
+	char* end;
+	while (*s && n < max)
+	{
+		list[n++] = strtoul(s, &end, 10);
+		if (end == s) return -1;
+		s = *end == ',' ? end + 1 : end;
+	}
+	return n;
+}
+
+static void usage(void)
+{
+	puts("usage: fcbench [options]\n"
+	     "  -s <MB>        volume size (4096)\n"
+	     "  -t <ms>        duration of each configuration (1000)\n"
+	     "  -b <KB,...>    block sizes (64,256,1024)\n"
+	     "  -i <KB,...>    I/O sizes (4,64,1024)\n"
+	     "  -j <n,...>     thread counts (1,4,16)\n"
+	     "  -r <%,...>     initial residency (0,50,90,100)\n"
+	     "  -o <us>        origin latency (2000)\n"
+	     "  -O <MB/s>      origin bandwidth, 0 for unlimited (200)\n"
+	     "  -c <us>        cache latency (100)\n"
+	     "  -C <MB/s>      cache bandwidth, 0 for unlimited (1000)\n"
+	     "  -q <n>         queue depth of each device (32)\n"
+	     "  -a <blocks>    readahead (0)\n"
+	     "  -S <KB>        sub-block size, 0 for none (0)\n"
+	     "  -p <n>         partly copied blocks kept (65536)\n"
+	     "  -e <n>         fail every n-th request to the caches, 0 for none (0)\n"
+	     "  -E <n>         errors to bypass the caches, 0 never (16)\n"
+	     "  -m <n>         targets on the same origin (1)\n"
+	     "  -x             share fetches from origin between targets\n"
+	     "  -k <KB>        shared fetches kept in memory (0)\n"
+	     "  -R             record the access trace while reading\n"
+	     "  -P             prewarm with the trace of a first pass");
+}
+
+#define MAX_VALUES 16
+
+int main(int argc, char** argv)
+{
+	int c, nb = 3, ni = 3, nj = 3, nr = 4, ret = 0;
+	int b_, i_, j_, r_;
+	unsigned int bs[MAX_VALUES] = {64, 256, 1024};
+	unsigned int io[MAX_VALUES] = {4, 64, 1024};
+	unsigned int threads[MAX_VALUES] = {1, 4, 16};
+	unsigned int residency[MAX_VALUES] = {0, 50, 90, 100};
+	unsigned int origin_lat = 2000, origin_bw = 200;
+	unsigned int cache_lat = 100, cache_bw = 1000, depth = 32;
+	struct bench b;
+
+	memset(&b, 0, sizeof(b));
+	b.size = 4096ULL << 20;
+	b.duration = 1000;
+	b.targets = 1;
+	b.error_threshold = -1;
+	while ((c = getopt(argc, argv, "s:t:b:i:j:r:o:O:c:C:q:a:S:p:e:E:m:xk:RPh")) != -1)
+	{
+		switch (c)
+		{
+		case 's': b.size = strtoull(optarg, NULL, 10) << 20; break;
+		case 't': b.duration = atoi(optarg); break;
+		case 'b': nb = parse_list(optarg, bs, MAX_VALUES); break;
+		case 'i': ni = parse_list(optarg, io, MAX_VALUES); break;
+		case 'j': nj = parse_list(optarg, threads, MAX_VALUES); break;
+		case 'r': nr = parse_list(optarg, residency, MAX_VALUES); break;
+		case 'o': origin_lat = atoi(optarg); break;
+		case 'O': origin_bw = atoi(optarg); break;
+		case 'c': cache_lat = atoi(optarg); break;
+		case 'C': cache_bw = atoi(optarg); break;
+		case 'q': depth = atoi(optarg); break;
+		case 'a': b.readahead = atoi(optarg); break;
+		case 'S': b.subblock = atoi(optarg); break;
+		case 'p': b.partial_blocks = atoi(optarg); break;
+		case 'e': b.fail_every = atoi(optarg); break;
+		case 'E': b.error_threshold = atoi(optarg); break;
+		case 'm': b.targets = atoi(optarg); break;
+		case 'x': b.shared = true; break;
+		case 'k': fc_shared_cache_kb = atoi(optarg); break;
+		case 'R': b.mode = BENCH_RECORD; break;
+		case 'P': b.mode = BENCH_PREWARM; break;
+		default: usage(); return c == 'h' ? 0 : 1;
+		}
+	}
+	if (nb <= 0 || ni <= 0 || nj <= 0 || nr <= 0 || b.size == 0)
+	{
+		usage();
+		return 1;
+	}
+	if (b.targets == 0 || b.targets > MAX_TARGETS || 
+		(b.targets > 1 && b.mode == BENCH_PREWARM))
+	{
+		fprintf(stderr, "1 to %u targets, and only one with -P\n", MAX_TARGETS);
+		return 1;
+	}
+	if (b.subblock && (b.subblock < 4 || (b.subblock & (b.subblock-1))))
+	{
+		fprintf(stderr, "sub-block size %uKB must be a power of 2\n", b.subblock);
+		return 1;
+	}
+	for (b_=0; b_<nb; ++b_)
+	{
+		if (bs[b_] < 4 || (bs[b_] & (bs[b_]-1)) || (b.size >> 10) % bs[b_])
+		{
+			fprintf(stderr, "block size %uKB must be a power of 2 "
+				"dividing the volume\n", bs[b_]);
+			return 1;
+		}
+	}
+
+	mock_init();
+	mock_device_init(&b.origin, 1, origin_lat, origin_bw, depth);
+	mock_device_init(&b.meta, 2, cache_lat, cache_bw, depth);
+	b.origin_dev.bdev = &b.origin;
+	b.meta_dev.bdev = &b.meta;
+	strcpy(b.origin_dev.name, "origin");
+	strcpy(b.meta_dev.name, "meta");
+	for (i_=0; i_<b.targets; ++i_)
+	{
+		mock_device_init(&b.caches[i_], 3 + i_, cache_lat, cache_bw, depth);
+		mock_device_fail(&b.caches[i_], b.fail_every);
+		b.cache_devs[i_].bdev = &b.caches[i_];
+		sprintf(b.cache_devs[i_].name, "cache%d", i_);
+	}
+
+	printf("block_kb,io_kb,threads,residency,ios,iops,mbps,"
+		"p50_us,p99_us,p999_us,max_us,hits,misses,copied_mb,origin_mb\n");
+	for (b_=0; b_<nb; ++b_)
+	for (i_=0; i_<ni; ++i_)
+	for (j_=0; j_<nj; ++j_)
+	for (r_=0; r_<nr; ++r_)
+	{
+		if (io[i_] == 0 || (b.size >> 10) < io[i_] || threads[j_] == 0) continue;
+		if (run(&b, bs[b_], io[i_], threads[j_], residency[r_]))
+		{
+			fprintf(stderr, "inconsistent state after block_kb=%u io_kb=%u "
+				"threads=%u residency=%u\n", bs[b_], io[i_],
+				threads[j_], residency[r_]);
+			ret = 1;
+		}
+	}
+	for (i_=0; i_<b.targets; ++i_)
+	{
+		mock_device_destroy(&b.caches[i_]);
+	}
+	mock_device_destroy(&b.meta);
+	mock_device_destroy(&b.origin);
+	return ret;
+}
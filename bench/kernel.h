@@ -0,0 +1,496 @@
+/*
+ * Just enough of the kernel API, on top of pthreads, to build the caching
+ * core in userspace. Block I/O (dm_io, dm_kcopyd and remapped bios) goes to
+ * the mock devices of mock.c, which simulate their latency and carry a tag
+ * for each sector.
+ *
+ * This file is released under the GPL.
+ */
+
+#ifndef _FC_KERNEL_H
+#define _FC_KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef u64 sector_t;
+
+#define __percpu
+#define __user
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+#define container_of(ptr, type, member) \
+	((type*)((char*)(ptr) - offsetof(type, member)))
+
+#define min(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); _x < _y ? _x : _y; })
+#define max(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); _x > _y ? _x : _y; })
+#define min_t(type, x, y) ({ type _x = (x); type _y = (y); _x < _y ? _x : _y; })
+#define max_t(type, x, y) ({ type _x = (x); type _y = (y); _x > _y ? _x : _y; })
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+
+static inline u64 div64_u64(u64 a, u64 b)
+{
+	return a / b;
+}
+
+#define printk			printf
+#define DMWARN(f, ...)		fprintf(stderr, DM_MSG_PREFIX ": " f "\n", ##__VA_ARGS__)
+#define DMERR			DMWARN
+
+/* memory */
+#define GFP_KERNEL		0
+#define GFP_NOIO		0
+#define GFP_ATOMIC		0
+#define GFP_NOWAIT		0
+#define kmalloc(size, gfp)	malloc(size)
+#define kzalloc(size, gfp)	calloc(1, size)
+#define kfree(p)		free(p)
+#define vzalloc(size)		calloc(1, size)
+#define vfree(p)		free(p)
+#define __vmalloc(size, gfp, prot)	malloc(size)
+#define __GFP_HIGHMEM		0
+#define PAGE_KERNEL		0
+#define PAGE_SIZE		4096
+
+struct page;
+
+typedef struct mempool_s {
+	size_t size;
+} mempool_t;
+
+static inline mempool_t* mempool_create_kmalloc_pool(int min_nr, size_t size)
+{
+	mempool_t* pool = malloc(sizeof(*pool));
+	if (pool) pool->size = size;
+	return pool;
+}
+
+static inline mempool_t* mempool_create_page_pool(int min_nr, int order)
+{
+	return mempool_create_kmalloc_pool(min_nr, PAGE_SIZE << order);
+}
+
+#define mempool_alloc(pool, gfp)	malloc((pool)->size)
+#define mempool_free(p, pool)		free(p)
+#define mempool_destroy(pool)		free(pool)
+
+/* a single "cpu" updated atomically */
+#define alloc_percpu(type)		((type*)calloc(1, sizeof(type)))
+#define free_percpu(p)			free(p)
+#define per_cpu_ptr(p, cpu)		((void)(cpu), (p))
+#define for_each_possible_cpu(cpu)	for ((cpu)=0; (cpu)<1; ++(cpu))
+#define this_cpu_add(x, v)		__sync_fetch_and_add(&(x), (v))
+#define this_cpu_inc(x)			this_cpu_add(x, 1)
+#define raw_smp_processor_id()		0
+#define cpu_online(cpu)			((cpu) == 0)
+
+/* time, in jiffies of 1ms */
+#define HZ 1000
+u64 fc_jiffies(void);
+#define jiffies				((unsigned long)fc_jiffies())
+#define get_jiffies_64()		fc_jiffies()
+#define msecs_to_jiffies(ms)		((unsigned long)(ms))
+#define jiffies_to_msecs(j)		((unsigned int)(j))
+#define time_after(a, b)		((long)((b) - (a)) < 0)
+#define time_before(a, b)		time_after(b, a)
+#define msleep(ms)			usleep((ms) * 1000)
+
+typedef s64 ktime_t;
+ktime_t ktime_get(void);
+ktime_t ktime_get_real(void);
+#define ktime_sub(a, b)			((a) - (b))
+#define ktime_to_us(t)			((t) / 1000)
+#define ktime_to_ns(t)			(t)
+
+/* barriers and atomics */
+#define smp_mb()			__sync_synchronize()
+#define smp_rmb()			__sync_synchronize()
+#define smp_wmb()			__sync_synchronize()
+#define smp_mb__before_clear_bit()	__sync_synchronize()
+#define smp_mb__after_clear_bit()	__sync_synchronize()
+
+#define READ_ONCE(x)			__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)		__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define cmpxchg(p, old, new)		__sync_val_compare_and_swap(p, old, new)
+#define cmpxchg64			cmpxchg
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long long counter; } atomic64_t;
+
+#define atomic_read(v)			__atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_set(v, i)		__atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_inc(v)			((void)__sync_add_and_fetch(&(v)->counter, 1))
+#define atomic_dec(v)			((void)__sync_sub_and_fetch(&(v)->counter, 1))
+#define atomic_inc_return(v)		__sync_add_and_fetch(&(v)->counter, 1)
+#define atomic_dec_return(v)		__sync_sub_and_fetch(&(v)->counter, 1)
+#define atomic_dec_and_test(v)		(atomic_dec_return(v) == 0)
+#define atomic64_read			atomic_read
+#define atomic64_set			atomic_set
+#define atomic64_inc			atomic_inc
+#define atomic64_dec			atomic_dec
+#define atomic64_inc_return		atomic_inc_return
+#define atomic64_add(i, v)		((void)__sync_add_and_fetch(&(v)->counter, (i)))
+#define atomic64_sub(i, v)		((void)__sync_sub_and_fetch(&(v)->counter, (i)))
+
+/* bitops */
+#define BITS_PER_LONG			(8 * sizeof(long))
+#define BITS_TO_LONGS(n)		DIV_ROUND_UP(n, BITS_PER_LONG)
+#define BIT_WORD(nr)			((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)			(1UL << ((nr) % BITS_PER_LONG))
+
+static inline void set_bit(unsigned long nr, volatile unsigned long* addr)
+{
+	__atomic_fetch_or(addr + BIT_WORD(nr), BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+
+static inline void clear_bit(unsigned long nr, volatile unsigned long* addr)
+{
+	__atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+
+static inline int test_bit(unsigned long nr, const volatile unsigned long* addr)
+{
+	return (__atomic_load_n(addr + BIT_WORD(nr), __ATOMIC_RELAXED) >>
+		(nr % BITS_PER_LONG)) & 1;
+}
+
+static inline int test_and_set_bit(unsigned long nr, volatile unsigned long* addr)
+{
+	return (__atomic_fetch_or(addr + BIT_WORD(nr), BIT_MASK(nr),
+		__ATOMIC_SEQ_CST) & BIT_MASK(nr)) != 0;
+}
+
+static inline int test_and_clear_bit(unsigned long nr, volatile unsigned long* addr)
+{
+	return (__atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr),
+		__ATOMIC_SEQ_CST) & BIT_MASK(nr)) != 0;
+}
+
+static inline unsigned long find_next_bit_(const unsigned long* addr,
+	unsigned long size, unsigned long offset, unsigned long invert)
+{
+	unsigned long word;
+	while (offset < size)
+	{
+		word = (addr[BIT_WORD(offset)] ^ invert) >> (offset % BITS_PER_LONG);
+		if (word) return min(offset + __builtin_ctzl(word), size);
+		offset = (BIT_WORD(offset) + 1) * BITS_PER_LONG;
+	}
+	return size;
+}
+
+#define find_next_bit(addr, size, offset)	find_next_bit_(addr, size, offset, 0)
+#define find_next_zero_bit(addr, size, offset)	find_next_bit_(addr, size, offset, ~0UL)
+#define find_first_zero_bit(addr, size)	find_next_zero_bit(addr, size, 0)
+
+static inline void bitmap_set(unsigned long* map, unsigned int start, int len)
+{
+	for (; len>0; --len, ++start)
+	{
+		map[BIT_WORD(start)] |= BIT_MASK(start);
+	}
+}
+
+#define for_each_set_bit(bit, addr, size)			\
+	for ((bit) = find_next_bit((addr), (size), 0);		\
+	     (bit) < (size);					\
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline unsigned long hash_long(unsigned long val, unsigned int bits)
+{
+	return (u64)val * 0x9e37fffffffc0001ULL >> (64 - bits);
+}
+
+/* lists */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD(name)		struct list_head name = { &(name), &(name) }
+
+static inline void INIT_LIST_HEAD(struct list_head* list)
+{
+	list->next = list->prev = list;
+}
+
+static inline void __list_add(struct list_head* new,
+	struct list_head* prev, struct list_head* next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head* new, struct list_head* head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head* new, struct list_head* head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head* entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+}
+
+static inline void list_del_init(struct list_head* entry)
+{
+	list_del(entry);
+	INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move(struct list_head* list, struct list_head* head)
+{
+	list_del(list);
+	list_add(list, head);
+}
+
+static inline void list_move_tail(struct list_head* list, struct list_head* head)
+{
+	list_del(list);
+	list_add_tail(list, head);
+}
+
+static inline int list_empty(const struct list_head* head)
+{
+	return head->next == head;
+}
+
+static inline void list_splice_init(struct list_head* list, struct list_head* head)
+{
+	if (list_empty(list)) return;
+	list->next->prev = head;
+	list->prev->next = head->next;
+	head->next->prev = list->prev;
+	head->next = list->next;
+	INIT_LIST_HEAD(list);
+}
+
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+#define list_for_each_entry(pos, head, member)				\
+	for (pos = list_entry((head)->next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = list_entry(pos->member.next, typeof(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member)			\
+	for (pos = list_entry((head)->next, typeof(*pos), member),	\
+		n = list_entry(pos->member.next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+/* locking */
+typedef pthread_mutex_t spinlock_t;
+#define DEFINE_SPINLOCK(l)		spinlock_t l = PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(l)		pthread_mutex_init(l, NULL)
+#define spin_lock(l)			pthread_mutex_lock(l)
+#define spin_unlock(l)			pthread_mutex_unlock(l)
+#define spin_lock_irqsave(l, flags)	((flags) = 0, pthread_mutex_lock(l))
+#define spin_unlock_irqrestore(l, flags) ((void)(flags), pthread_mutex_unlock(l))
+
+/* deferred work, run by one thread per workqueue */
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct* work);
+
+struct work_struct {
+	struct list_head entry;
+	work_func_t func;
+	int pending;
+};
+
+struct workqueue_struct;
+
+#define INIT_WORK(w, f) do {			\
+	INIT_LIST_HEAD(&(w)->entry);		\
+	(w)->func = (f);			\
+	(w)->pending = 0;			\
+} while (0)
+
+bool queue_work(struct workqueue_struct* wq, struct work_struct* work);
+bool schedule_work(struct work_struct* work);
+bool flush_work(struct work_struct* work);
+bool cancel_work_sync(struct work_struct* work);
+
+#define WQ_MEM_RECLAIM			(1 << 3)
+#define WQ_HIGHPRI			(1 << 4)
+#define queue_work_on(cpu, wq, work)	((void)(cpu), queue_work(wq, work))
+
+struct workqueue_struct* alloc_workqueue(const char* name, unsigned int flags, 
+	int max_active);
+void flush_workqueue(struct workqueue_struct* wq);
+void destroy_workqueue(struct workqueue_struct* wq);
+
+struct timer_list {
+	struct list_head entry;
+	unsigned long expires;
+	void (*function)(unsigned long);
+	unsigned long data;
+	int pending;
+};
+
+void setup_timer(struct timer_list* timer,
+	void (*function)(unsigned long), unsigned long data);
+int mod_timer(struct timer_list* timer, unsigned long expires);
+int del_timer_sync(struct timer_list* timer);
+
+/* the block layer */
+#define READ			0
+#define WRITE			1
+#define SECTOR_SHIFT		9
+#define BIO_UPTODATE		0
+
+struct blk_plug {
+	int unused;
+};
+
+#define blk_start_plug(plug)	((void)(plug))
+#define blk_finish_plug(plug)	((void)(plug))
+
+struct block_device {
+	dev_t bd_dev;
+	unsigned int latency_us;	// per request
+	unsigned int bandwidth;		// MB/s, 0 for unlimited
+	sem_t slots;			// queue depth
+	u64 bytes;			// transferred
+	u64* tags;			// held by each sector, NULL if its own number
+	sector_t sectors;		// tagged
+	unsigned int fail_every;	// requests, 0 for none failing
+	u64 requests;
+};
+
+struct bio_vec {
+	void* bv_page;
+	unsigned int bv_len;
+	unsigned int bv_offset;
+};
+
+struct bio;
+typedef void (bio_end_io_t)(struct bio*, int);
+
+struct bio {
+	sector_t bi_sector;
+	struct block_device* bi_bdev;
+	unsigned long bi_flags;
+	unsigned long bi_rw;
+	unsigned short bi_idx;
+	unsigned int bi_size;
+	struct bio_vec* bi_io_vec;
+	bio_end_io_t* bi_end_io;
+	void* bi_private;
+};
+
+#define bio_data_dir(bio)	((bio)->bi_rw & WRITE)
+
+void bio_endio(struct bio* bio, int error);
+
+/* device-mapper */
+#define DM_MAPIO_SUBMITTED	0
+#define DM_MAPIO_REMAPPED	1
+#define DM_ENDIO_INCOMPLETE	1
+
+union map_info {
+	void* ptr;
+	unsigned long long ll;
+};
+
+struct dm_dev {
+	struct block_device* bdev;
+	char name[16];
+};
+
+struct dm_io_region {
+	struct block_device* bdev;
+	sector_t sector;
+	sector_t count;
+};
+
+enum dm_io_mem_type {
+	DM_IO_PAGE_LIST,
+	DM_IO_BVEC,
+	DM_IO_VMA,
+	DM_IO_KMEM,
+};
+
+struct page_list {
+	struct page_list* next;
+	struct page* page;
+};
+
+struct dm_io_memory {
+	enum dm_io_mem_type type;
+	unsigned offset;		// into the first page of a page list
+	union {
+		struct page_list* pl;
+		struct bio_vec* bvec;
+		void* vma;
+		void* addr;
+	} ptr;
+};
+
+typedef void (*io_notify_fn)(unsigned long error, void* context);
+
+struct dm_io_notify {
+	io_notify_fn fn;
+	void* context;
+};
+
+struct dm_io_client;
+#define dm_io_client_create()		((struct dm_io_client*)NULL)
+#define dm_io_client_destroy(c)		((void)(c))
+#define IS_ERR(p)			((void)(p), 0)
+
+struct dm_io_request {
+	int bi_rw;
+	struct dm_io_memory mem;
+	struct dm_io_notify notify;
+	struct dm_io_client* client;
+};
+
+int dm_io(struct dm_io_request* io_req, unsigned num_regions,
+	struct dm_io_region* region, unsigned long* sync_error_bits);
+
+struct dm_kcopyd_client;
+typedef void (*dm_kcopyd_notify_fn)(int read_err, unsigned long write_err,
+	void* context);
+
+int dm_kcopyd_copy(struct dm_kcopyd_client* kc, struct dm_io_region* from,
+	unsigned int num_dests, struct dm_io_region* dests,
+	unsigned int flags, dm_kcopyd_notify_fn fn, void* context);
+
+/* tracepoints are compiled out */
+#define trace_foolcache_map(...)		do { } while (0)
+#define trace_foolcache_copy_start(...)		do { } while (0)
+#define trace_foolcache_copy_end(...)		do { } while (0)
+#define trace_foolcache_wait_start(...)		do { } while (0)
+#define trace_foolcache_wait_end(...)		do { } while (0)
+#define trace_foolcache_defer(...)		do { } while (0)
+#define trace_foolcache_flush_start(...)	do { } while (0)
+#define trace_foolcache_flush_end(...)		do { } while (0)
+#define trace_foolcache_bypass(...)		do { } while (0)
+
+#endif /* _FC_KERNEL_H */
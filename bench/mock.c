@@ -0,0 +1,542 @@
+/*
+ * A mock of the block layer for the userspace build of the caching core.
+ *
+ * Requests occupy a slot of their device for as long as the device would take
+ * to serve them, then move their data and complete. Data is a tag per sector,
+ * the number of the origin sector it came from, so that whatever is read can
+ * be checked to be the right origin data. Requests are run by
+ * a pool of threads that grows whenever all of them are busy, as callbacks
+ * may block waiting for other requests.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <time.h>
+#include "mock.h"
+
+static struct timespec boot;
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)(ts.tv_sec - boot.tv_sec) * 1000000000ULL + ts.tv_nsec - boot.tv_nsec;
+}
+
+u64 fc_jiffies(void)
+{
+	return now_ns() / 1000000 + 1000;	// never 0
+}
+
+ktime_t ktime_get(void)
+{
+	return now_ns();
+}
+
+ktime_t ktime_get_real(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* workqueues */
+struct workqueue_struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head works;
+	struct work_struct* running;
+	int stop;
+	pthread_t thread;
+};
+
+static struct workqueue_struct system_wq;
+
+static void* worker_thread(void* arg)
+{
+	struct workqueue_struct* wq = arg;
+	struct work_struct* work;
+	pthread_mutex_lock(&wq->lock);
+	while (1)
+	{
+		while (list_empty(&wq->works) && !wq->stop)
+		{
+			pthread_cond_wait(&wq->cond, &wq->lock);
+		}
+		if (list_empty(&wq->works)) break;
+		work = list_first_entry(&wq->works, struct work_struct, entry);
+		list_del_init(&work->entry);
+		work->pending = 0;
+		wq->running = work;
+		pthread_mutex_unlock(&wq->lock);
+		work->func(work);
+		pthread_mutex_lock(&wq->lock);
+		wq->running = NULL;
+		pthread_cond_broadcast(&wq->cond);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+static void init_workqueue(struct workqueue_struct* wq)
+{
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+	INIT_LIST_HEAD(&wq->works);
+	wq->running = NULL;
+	wq->stop = 0;
+	pthread_create(&wq->thread, NULL, worker_thread, wq);
+}
+
+// one thread whatever the flags, there is a single cpu
+struct workqueue_struct* alloc_workqueue(const char* name, unsigned int flags, 
+	int max_active)
+{
+	struct workqueue_struct* wq = calloc(1, sizeof(*wq));
+	if (wq) init_workqueue(wq);
+	return wq;
+}
+
+void flush_workqueue(struct workqueue_struct* wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	while (!list_empty(&wq->works) || wq->running)
+	{
+		pthread_cond_wait(&wq->cond, &wq->lock);
+	}
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void destroy_workqueue(struct workqueue_struct* wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = 1;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+	pthread_join(wq->thread, NULL);
+	free(wq);
+}
+
+bool queue_work(struct workqueue_struct* wq, struct work_struct* work)
+{
+	bool queued = false;
+	pthread_mutex_lock(&wq->lock);
+	if (!work->pending)
+	{
+		work->pending = 1;
+		list_add_tail(&work->entry, &wq->works);
+		pthread_cond_broadcast(&wq->cond);
+		queued = true;
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return queued;
+}
+
+bool schedule_work(struct work_struct* work)
+{
+	return queue_work(&system_wq, work);
+}
+
+bool flush_work(struct work_struct* work)
+{
+	struct workqueue_struct* wq = &system_wq;
+	bool busy = false;
+	pthread_mutex_lock(&wq->lock);
+	while (work->pending || wq->running == work)
+	{
+		busy = true;
+		pthread_cond_wait(&wq->cond, &wq->lock);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return busy;
+}
+
+bool cancel_work_sync(struct work_struct* work)
+{
+	struct workqueue_struct* wq = &system_wq;
+	bool pending;
+	pthread_mutex_lock(&wq->lock);
+	pending = work->pending;
+	if (pending)
+	{
+		list_del_init(&work->entry);
+		work->pending = 0;
+	}
+	while (wq->running == work)
+	{
+		pthread_cond_wait(&wq->cond, &wq->lock);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return pending;
+}
+
+/* timers, checked every jiffy */
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(timers);
+static struct timer_list* timer_running;
+
+static void* timer_thread(void* arg)
+{
+	struct timer_list *timer, *tmp;
+	while (1)
+	{
+		usleep(1000000 / HZ);
+		pthread_mutex_lock(&timer_lock);
+again:
+		list_for_each_entry_safe(timer, tmp, &timers, entry)
+		{
+			if (time_before(jiffies, timer->expires)) continue;
+			list_del_init(&timer->entry);
+			timer->pending = 0;
+			timer_running = timer;
+			pthread_mutex_unlock(&timer_lock);
+			timer->function(timer->data);
+			pthread_mutex_lock(&timer_lock);
+			timer_running = NULL;
+			pthread_cond_broadcast(&timer_cond);
+			goto again;
+		}
+		pthread_mutex_unlock(&timer_lock);
+	}
+	return NULL;
+}
+
+void setup_timer(struct timer_list* timer,
+	void (*function)(unsigned long), unsigned long data)
+{
+	INIT_LIST_HEAD(&timer->entry);
+	timer->function = function;
+	timer->data = data;
+	timer->pending = 0;
+}
+
+int mod_timer(struct timer_list* timer, unsigned long expires)
+{
+	int pending;
+	pthread_mutex_lock(&timer_lock);
+	pending = timer->pending;
+	timer->expires = expires;
+	if (!pending)
+	{
+		timer->pending = 1;
+		list_add_tail(&timer->entry, &timers);
+	}
+	pthread_mutex_unlock(&timer_lock);
+	return pending;
+}
+
+int del_timer_sync(struct timer_list* timer)
+{
+	int pending;
+	pthread_mutex_lock(&timer_lock);
+	pending = timer->pending;
+	if (pending)
+	{
+		list_del_init(&timer->entry);
+		timer->pending = 0;
+	}
+	while (timer_running == timer)
+	{
+		pthread_cond_wait(&timer_cond, &timer_lock);
+	}
+	pthread_mutex_unlock(&timer_lock);
+	return pending;
+}
+
+/* devices and requests */
+struct mock_io {
+	struct list_head list;
+	struct block_device* src;	// copied from, NULL if not a copy
+	struct block_device* dst;
+	sector_t src_sector, sector, count;
+	int rw;
+	int src_error, error;		// of the device read, and written or read
+	struct dm_io_memory mem;	// read into or written from, if not a copy
+	void (*done)(struct mock_io* io);
+	union {
+		struct dm_io_notify notify;
+		struct {
+			dm_kcopyd_notify_fn fn;
+			void* context;
+		} copy;
+		struct bio* bio;
+	};
+};
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(ios);
+static unsigned int ios_queued, ios_idle;
+
+void mock_device_init(struct block_device* bdev, dev_t dev,
+	unsigned int latency_us, unsigned int bandwidth, unsigned int depth)
+{
+	bdev->bd_dev = dev;
+	bdev->latency_us = latency_us;
+	bdev->bandwidth = bandwidth;
+	sem_init(&bdev->slots, 0, max(depth, 1U));
+}
+
+void mock_device_destroy(struct block_device* bdev)
+{
+	sem_destroy(&bdev->slots);
+	free(bdev->tags);
+}
+
+void mock_device_fail(struct block_device* bdev, unsigned int n)
+{
+	bdev->fail_every = n;
+	bdev->requests = 0;
+}
+
+void mock_device_store(struct block_device* bdev, sector_t sectors)
+{
+	free(bdev->tags);
+	bdev->tags = calloc(sectors, sizeof(u64));
+	if (bdev->tags == NULL)
+	{
+		perror("mock");
+		abort();
+	}
+	bdev->sectors = sectors;
+}
+
+static inline u64 read_tag(struct block_device* bdev, sector_t sector)
+{
+	if (bdev->tags == NULL) return sector + 1;
+	return sector < bdev->sectors ? bdev->tags[sector] : 0;
+}
+
+static inline void write_tag(struct block_device* bdev, sector_t sector, u64 tag)
+{
+	if (bdev->tags && sector < bdev->sectors) bdev->tags[sector] = tag;
+}
+
+void mock_device_fill(struct block_device* bdev, sector_t sector, sector_t count)
+{
+	for (; count; --count, ++sector)
+	{
+		write_tag(bdev, sector, sector + 1);
+	}
+}
+
+sector_t mock_device_check(struct block_device* bdev, sector_t sector, sector_t count)
+{
+	for (; count; --count, ++sector)
+	{
+		if (read_tag(bdev, sector) != sector + 1) break;
+	}
+	return sector;
+}
+
+// the bytes of the i-th sector of an I/O buffer
+static char* mem_sector(struct dm_io_memory* mem, sector_t i)
+{
+	struct bio_vec* bv;
+	struct page_list* pl;
+	size_t offset;
+	switch (mem->type)
+	{
+	case DM_IO_PAGE_LIST:
+		offset = mem->offset + i * 512;
+		for (pl = mem->ptr.pl; offset >= PAGE_SIZE; pl = pl->next)
+		{
+			offset -= PAGE_SIZE;
+		}
+		return (char*)pl->page + offset;
+	case DM_IO_BVEC:
+		for (bv = mem->ptr.bvec; i >= bv->bv_len / 512; ++bv)
+		{
+			i -= bv->bv_len / 512;
+		}
+		return (char*)bv->bv_page + bv->bv_offset + i * 512;
+	default:
+		return (char*)mem->ptr.vma + i * 512;
+	}
+}
+
+static void move_data(struct mock_io* io)
+{
+	sector_t i;
+	u64 tag;
+	for (i=0; i<io->count; ++i)
+	{
+		if (io->src)
+		{
+			tag = read_tag(io->src, io->src_sector + i);
+			write_tag(io->dst, io->sector + i, tag);
+		}
+		else if (io->mem.ptr.vma == NULL)
+		{	// a bio without data
+			break;
+		}
+		else if (io->rw == READ)
+		{
+			tag = read_tag(io->dst, io->sector + i);
+			memcpy(mem_sector(&io->mem, i), &tag, sizeof(tag));
+		}
+		else
+		{
+			memcpy(&tag, mem_sector(&io->mem, i), sizeof(tag));
+			write_tag(io->dst, io->sector + i, tag);
+		}
+	}
+}
+
+// returns -EIO if the request fails
+static int device_access(struct block_device* bdev, sector_t count)
+{
+	u64 us = bdev->latency_us;
+	if (bdev->bandwidth)
+	{
+		us += count * 512 / bdev->bandwidth;	// MB/s is bytes per us
+	}
+	__sync_fetch_and_add(&bdev->bytes, count * 512);
+	sem_wait(&bdev->slots);
+	if (us) usleep(us);
+	sem_post(&bdev->slots);
+	if (bdev->fail_every && 
+		__sync_add_and_fetch(&bdev->requests, 1) % bdev->fail_every == 0)
+		return -EIO;
+	return 0;
+}
+
+static void* io_thread(void* arg)
+{
+	struct mock_io* io;
+	while (1)
+	{
+		pthread_mutex_lock(&io_lock);
+		while (list_empty(&ios))
+		{
+			ios_idle++;
+			pthread_cond_wait(&io_cond, &io_lock);
+			ios_idle--;
+		}
+		io = list_first_entry(&ios, struct mock_io, list);
+		list_del(&io->list);
+		ios_queued--;
+		pthread_mutex_unlock(&io_lock);
+
+		if (io->src) io->src_error = device_access(io->src, io->count);
+		if (io->src_error == 0)
+		{
+			io->error = device_access(io->dst, io->count);
+			if (io->error == 0) move_data(io);
+		}
+		io->done(io);
+		free(io);
+	}
+	return NULL;
+}
+
+static void submit(struct mock_io* io)
+{
+	pthread_t thread;
+	pthread_mutex_lock(&io_lock);
+	list_add_tail(&io->list, &ios);
+	if (++ios_queued > ios_idle)
+	{	// every thread may be blocked in a callback
+		pthread_create(&thread, NULL, io_thread, NULL);
+		pthread_detach(thread);
+	}
+	else
+	{
+		pthread_cond_signal(&io_cond);
+	}
+	pthread_mutex_unlock(&io_lock);
+}
+
+static struct mock_io* alloc_io(struct block_device* src,
+	struct block_device* dst, sector_t count, void (*done)(struct mock_io*))
+{
+	struct mock_io* io = calloc(1, sizeof(*io));
+	if (io == NULL)
+	{
+		perror("mock");
+		abort();
+	}
+	io->src = src;
+	io->dst = dst;
+	io->count = count;
+	io->done = done;
+	return io;
+}
+
+void bio_endio(struct bio* bio, int error)
+{
+	if (error)
+		clear_bit(BIO_UPTODATE, &bio->bi_flags);
+	else
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio->bi_end_io(bio, error);
+}
+
+static void bio_done(struct mock_io* io)
+{
+	bio_endio(io->bio, io->error);
+}
+
+void mock_submit_bio(struct bio* bio)
+{
+	struct mock_io* io = alloc_io(NULL, bio->bi_bdev, bio->bi_size/512, bio_done);
+	io->bio = bio;
+	io->sector = bio->bi_sector;
+	io->rw = bio_data_dir(bio);
+	io->mem.type = DM_IO_BVEC;
+	io->mem.ptr.bvec = bio->bi_io_vec ? bio->bi_io_vec + bio->bi_idx : NULL;
+	submit(io);
+}
+
+static void dm_io_done(struct mock_io* io)
+{
+	io->notify.fn(io->error ? 1 : 0, io->notify.context);	// region 0 failed
+}
+
+int dm_io(struct dm_io_request* io_req, unsigned num_regions,
+	struct dm_io_region* region, unsigned long* sync_error_bits)
+{
+	struct mock_io* io;
+	io = alloc_io(NULL, region->bdev, region->count, dm_io_done);
+	io->sector = region->sector;
+	io->rw = io_req->bi_rw & WRITE;
+	io->mem = io_req->mem;
+	if (io_req->notify.fn == NULL)
+	{
+		int r = device_access(region->bdev, region->count);
+		if (r == 0) move_data(io);
+		free(io);
+		return r;
+	}
+	io->notify = io_req->notify;
+	submit(io);
+	return 0;
+}
+
+static void copy_done(struct mock_io* io)
+{
+	io->copy.fn(io->src_error ? 1 : 0, io->error ? 1 : 0, io->copy.context);
+}
+
+int dm_kcopyd_copy(struct dm_kcopyd_client* kc, struct dm_io_region* from,
+	unsigned int num_dests, struct dm_io_region* dests,
+	unsigned int flags, dm_kcopyd_notify_fn fn, void* context)
+{
+	struct mock_io* io = alloc_io(from->bdev, dests->bdev, from->count, copy_done);
+	io->src_sector = from->sector;
+	io->sector = dests->sector;
+	io->copy.fn = fn;
+	io->copy.context = context;
+	submit(io);
+	return 0;
+}
+
+void mock_init(void)
+{
+	pthread_t thread;
+	clock_gettime(CLOCK_MONOTONIC, &boot);
+	init_workqueue(&system_wq);
+	pthread_create(&thread, NULL, timer_thread, NULL);
+	pthread_detach(thread);
+}
@@ -0,0 +1,36 @@
+/*
+ * Mock block devices for the userspace build of the caching core.
+ *
+ * This file is released under the GPL.
+ */
+
+#ifndef _FC_MOCK_H
+#define _FC_MOCK_H
+
+#include "kernel.h"
+
+void mock_init(void);
+
+// a device serving depth requests at a time, each taking latency_us plus
+// the transfer time at bandwidth MB/s (0 for unlimited)
+void mock_device_init(struct block_device* bdev, dev_t dev,
+	unsigned int latency_us, unsigned int bandwidth, unsigned int depth);
+void mock_device_destroy(struct block_device* bdev);
+// fail every n-th request to the device, 0 for none, without moving data
+void mock_device_fail(struct block_device* bdev, unsigned int n);
+
+/*
+ * Sector s of the origin holds tag s+1 in its first 8 bytes, and I/O moves
+ * tags between devices and memory. A device given sectors to store starts
+ * with tags 0, that is never written.
+ */
+void mock_device_store(struct block_device* bdev, sector_t sectors);
+// mark sectors as holding their own tag, as if copied from origin
+void mock_device_fill(struct block_device* bdev, sector_t sector, sector_t count);
+// the first sector not holding its own tag, or sector+count
+sector_t mock_device_check(struct block_device* bdev, sector_t sector, sector_t count);
+
+// submit a bio remapped by the target to its bi_bdev
+void mock_submit_bio(struct bio* bio);
+
+#endif /* _FC_MOCK_H */
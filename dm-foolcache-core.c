@@ -0,0 +1,1628 @@
+/*
+ * The caching core of dm-foolcache: the map and copy state machine, the copy
+ * scheduler, error tracking and bitmap handling.
+ *
+ * This file is released under the GPL.
+ */
+
+#include "dm-foolcache.h"
+
+#ifdef __KERNEL__
+#define CREATE_TRACE_POINTS
+#include "dm-foolcache-trace.h"
+#endif
+
+static void fc_stats_account(struct foolcache_c* fcc, unsigned int path, 
+	ktime_t start)
+{
+	u64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+	unsigned int bucket = min_t(unsigned int, fls64(us), FC_HIST_BUCKETS-1);
+	this_cpu_inc(fcc->stats->hist[path][bucket]);
+	this_cpu_add(fcc->stats->total_us[path], us);
+}
+
+// sum up the per-cpu histogram of a path, returns the total latency
+u64 fc_stats_hist(struct foolcache_c* fcc, unsigned int path, u64* hist)
+{
+	int cpu, i;
+	u64 total = 0;
+	memset(hist, 0, sizeof(u64) * FC_HIST_BUCKETS);
+	for_each_possible_cpu(cpu)
+	{
+		struct fc_stats* st = per_cpu_ptr(fcc->stats, cpu);
+		for (i=0; i<FC_HIST_BUCKETS; ++i)
+		{
+			hist[i] += st->hist[path][i];
+		}
+		total += st->total_us[path];
+	}
+	return total;
+}
+
+static void write_bitmap_callback(unsigned long error, void *context)
+{
+	struct foolcache_c* fcc = context;
+	fc_stats_account(fcc, FC_PATH_FLUSH, fcc->flush_start);
+	trace_foolcache_flush_end(fc_dev(fcc), error);
+	atomic_dec(&fcc->bitmap_writes);
+}
+
+int write_bitmap(struct foolcache_c* fcc, io_notify_fn callback)
+{
+	int r;
+	struct dm_io_region region;
+	struct dm_io_request io_req;
+	
+	if (!READ_ONCE(fcc->bitmap_modified))
+	{
+		return 0;
+	}
+	// changes from now on make it modified again
+	WRITE_ONCE(fcc->bitmap_modified, 0);
+	smp_mb();
+
+	region.bdev = fcc->meta->bdev;
+	region.sector = fcc->bitmap_sector;
+	region.count = fcc->bitmap_sectors;
+	io_req.bi_rw = WRITE;
+	io_req.mem.type = DM_IO_VMA;
+	io_req.mem.ptr.vma = fcc->bitmap;
+	io_req.notify.fn = callback;
+	io_req.notify.context = fcc;
+	io_req.client = fcc->io_client;
+
+	fcc->flush_start = ktime_get();
+	trace_foolcache_flush_start(fc_dev(fcc), region.sector, region.count);
+	this_cpu_inc(fcc->stats->meta_writes);
+	this_cpu_add(fcc->stats->meta_bytes, region.count * 512);
+	if (callback) atomic_inc(&fcc->bitmap_writes);
+	r = dm_io(&io_req, 1, &region, NULL);
+	if (r!=0)
+	{
+		if (callback) atomic_dec(&fcc->bitmap_writes);
+		WRITE_ONCE(fcc->bitmap_modified, 1);
+		return r;
+	}
+	if (callback == NULL)
+	{
+		fc_stats_account(fcc, FC_PATH_FLUSH, fcc->flush_start);
+		trace_foolcache_flush_end(fc_dev(fcc), 0);
+	}
+	return 0;
+}
+
+// for the asynchronous writes of the bitmap to land, once no bio can start one
+void wait_bitmap(struct foolcache_c* fcc)
+{
+	while (atomic_read(&fcc->bitmap_writes))
+	{
+		msleep(1);
+	}
+}
+
+static void do_read_async_callback(unsigned long error, void* context)
+{
+	struct job_kcopyd* job = context;
+//	struct foolcache_c* fcc = job->fcc;
+	struct bio* bio = job->bio;
+	
+	kfree(job);
+	bio_endio(bio, unlikely(error) ? -EIO : 0);
+}
+
+static void do_read_async(struct job_kcopyd* job, struct dm_dev* target)
+{
+	struct foolcache_c* fcc = job->fcc;
+	struct bio* bio = job->bio;
+	struct dm_io_region region;
+	struct dm_io_request io_req;
+	
+	job->io->from_cache = (target == fcc->cache);
+	region.bdev = target->bdev;
+	region.sector = bio->bi_sector;
+	region.count = bio->bi_size/512;
+	io_req.bi_rw = bio->bi_rw;
+	io_req.mem.type = DM_IO_BVEC;
+	io_req.mem.ptr.bvec = bio->bi_io_vec + bio->bi_idx;
+	io_req.notify.fn = do_read_async_callback;
+	io_req.notify.context = job;
+	io_req.client = fcc->io_client;
+
+	dm_io(&io_req, 1, &region, NULL);
+}
+
+static inline struct list_head* partial_bucket(struct foolcache_c* fcc, 
+	unsigned long block)
+{
+	return &fcc->partial_hash[hash_long(block, FC_PARTIAL_HASH_BITS)];
+}
+
+// partial_lock held
+static struct fc_partial* find_partial(struct foolcache_c* fcc, 
+	unsigned long block)
+{
+	struct fc_partial* p;
+	list_for_each_entry(p, partial_bucket(fcc, block), list)
+	{
+		if (p->block == block) return p;
+	}
+	return NULL;
+}
+
+// partial_lock held
+static void free_partial(struct foolcache_c* fcc, struct fc_partial* p)
+{
+	list_del(&p->list);
+	list_del(&p->lru);
+	kfree(p);
+	fcc->partial_blocks--;
+}
+
+// partial_lock held, makes room for one more partial block if it can
+static bool evict_partial(struct foolcache_c* fcc)
+{
+	struct fc_partial* p;
+	list_for_each_entry(p, &fcc->partial_lru, lru)
+	{	// the holder of a copying bit may use its sub-blocks unlocked
+		if (test_bit(p->block, fcc->copying)) continue;
+		free_partial(fcc, p);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * The valid sub-blocks of a block, created empty if there is room. Only the
+ * holder of the block's copying bit may call this, or change the sub-blocks.
+ */
+static struct fc_partial* get_partial(struct foolcache_c* fcc, 
+	unsigned long block)
+{
+	unsigned long flags, i;
+	sector_t end = block2sector(fcc, block + 1);
+	struct fc_partial* p;
+
+	spin_lock_irqsave(&fcc->partial_lock, flags);
+	p = find_partial(fcc, block);
+	if (p)
+	{
+		list_move_tail(&p->lru, &fcc->partial_lru);
+	}
+	else if (fcc->partial_blocks < fcc->max_partial_blocks || evict_partial(fcc))
+	{
+		p = kzalloc(sizeof(*p) + BITS_TO_LONGS(fcc->subblocks) * 
+			sizeof(unsigned long), GFP_ATOMIC);
+		if (p)
+		{
+			p->block = block;
+			for (i=0; end > fcc->sectors && i<fcc->subblocks; ++i)
+			{	// beyond the end of the last block
+				if (block2sector(fcc, block) + (i << fcc->subblock_shift) >= 
+					fcc->sectors)
+					set_bit(i, p->bits);
+			}
+			list_add(&p->list, partial_bucket(fcc, block));
+			list_add_tail(&p->lru, &fcc->partial_lru);
+			fcc->partial_blocks++;
+		}
+	}
+	spin_unlock_irqrestore(&fcc->partial_lock, flags);
+	return p;
+}
+
+// forget the valid sub-blocks of a block, which is complete or invalidated
+void drop_partial(struct foolcache_c* fcc, unsigned long block)
+{
+	unsigned long flags;
+	struct fc_partial* p;
+	if (likely(fcc->partial_blocks == 0)) return;
+
+	spin_lock_irqsave(&fcc->partial_lock, flags);
+	p = find_partial(fcc, block);
+	if (p) free_partial(fcc, p);
+	spin_unlock_irqrestore(&fcc->partial_lock, flags);
+}
+
+static void free_partials(struct foolcache_c* fcc)
+{
+	struct fc_partial *p, *tmp;
+	list_for_each_entry_safe(p, tmp, &fcc->partial_lru, lru)
+	{
+		free_partial(fcc, p);
+	}
+}
+
+// the sub-blocks [*first, *last] of the block that the bio reads
+static inline void bio_subblocks(struct foolcache_c* fcc, struct bio* bio, 
+	unsigned long block, unsigned long* first, unsigned long* last)
+{
+	sector_t start = block2sector(fcc, block);
+	sector_t from = max_t(sector_t, bio->bi_sector, start);
+	sector_t to = min_t(sector_t, bio->bi_sector + bio->bi_size/512, 
+		start + fcc->block_size) - 1;
+	*first = (from - start) >> fcc->subblock_shift;
+	*last = (to - start) >> fcc->subblock_shift;
+}
+
+// whether the part of an uncached block that the bio reads is valid in cache
+static bool subblocks_valid(struct foolcache_c* fcc, struct bio* bio, 
+	unsigned long block)
+{
+	bool r = false;
+	unsigned long flags, first, last;
+	struct fc_partial* p;
+	if (likely(fcc->partial_blocks == 0)) return false;
+
+	bio_subblocks(fcc, bio, block, &first, &last);
+	spin_lock_irqsave(&fcc->partial_lock, flags);
+	p = find_partial(fcc, block);
+	if (p && find_next_zero_bit(p->bits, last + 1, first) > last)
+	{
+		list_move_tail(&p->lru, &fcc->partial_lru);
+		r = true;
+	}
+	spin_unlock_irqrestore(&fcc->partial_lock, flags);
+	return r;
+}
+
+static inline unsigned long find_next_copying_block(struct foolcache_c* fcc, 
+	struct bio* bio, unsigned long start, unsigned long end)
+{
+	for (;start<=end; ++start)
+	{
+		if (likely(test_bit(start, fcc->bitmap)) || 
+			subblocks_valid(fcc, bio, start))
+		{
+			atomic64_inc(&fcc->hits);
+		}
+		else
+		{
+			atomic64_inc(&fcc->misses);
+			return start;
+		}
+	}
+	return -1;
+}
+
+// release claims whose lease has expired, or all of them
+void expire_claims(struct foolcache_c* fcc, bool all)
+{
+	unsigned long i, flags;
+	struct fc_claim *claim, *tmp;
+	LIST_HEAD(expired);
+
+	if (list_empty(&fcc->claims)) return;
+	spin_lock_irqsave(&fcc->claim_lock, flags);
+	list_for_each_entry_safe(claim, tmp, &fcc->claims, list)
+	{
+		if (all || (claim->ready && time_after(jiffies, claim->expires)))
+		{
+			list_move(&claim->list, &expired);
+			fcc->nr_claims--;
+		}
+	}
+	spin_unlock_irqrestore(&fcc->claim_lock, flags);
+
+	list_for_each_entry_safe(claim, tmp, &expired, list)
+	{
+		for_each_set_bit(i, claim->bits, claim->count)
+		{
+			end_copying(fcc, claim->start + i);
+		}
+		kfree(claim);
+	}
+}
+
+static inline struct list_head* error_bucket(struct foolcache_c* fcc, 
+	unsigned long block)
+{
+	return &fcc->error_hash[hash_long(block, FC_ERROR_HASH_BITS)];
+}
+
+// error_lock held
+static struct fc_error* find_error(struct foolcache_c* fcc, unsigned long block)
+{
+	struct fc_error* e;
+	list_for_each_entry(e, error_bucket(fcc, block), list)
+	{
+		if (e->block == block) return e;
+	}
+	return NULL;
+}
+
+static void enter_bypass(struct foolcache_c* fcc)
+{
+	if (!fcc->bypassing)
+	{
+		DMWARN("too many errors, bypassing the cache");
+		trace_foolcache_bypass(fc_dev(fcc), 1);
+	}
+	fcc->bypass_until = jiffies + fcc->bypass_recover;
+	fcc->bypassing = 1;
+}
+
+void leave_bypass(struct foolcache_c* fcc)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&fcc->error_lock, flags);
+	if (fcc->bypassing)
+	{
+		trace_foolcache_bypass(fc_dev(fcc), 0);
+	}
+	fcc->bypassing = 0;
+	fcc->window_errors = 0;
+	fcc->window_start = jiffies;
+	spin_unlock_irqrestore(&fcc->error_lock, flags);
+}
+
+// error_lock held
+static void count_error(struct foolcache_c* fcc)
+{
+	unsigned long now = jiffies;
+	if (time_after(now, fcc->window_start + fcc->error_window))
+	{
+		fcc->window_start = now;
+		fcc->window_errors = 0;
+	}
+	if (fcc->error_threshold && ++fcc->window_errors >= fcc->error_threshold)
+	{
+		enter_bypass(fcc);
+	}
+}
+
+// a copy of the block failed, back off from copying it again
+static void block_failed(struct foolcache_c* fcc, unsigned long block)
+{
+	unsigned long flags;
+	struct fc_error* e;
+
+	spin_lock_irqsave(&fcc->error_lock, flags);
+	count_error(fcc);
+	e = find_error(fcc, block);
+	if (e == NULL)
+	{
+		if (fcc->error_blocks >= FC_MAX_ERROR_BLOCKS || 
+			(e = kmalloc(sizeof(*e), GFP_ATOMIC)) == NULL)
+		{
+			enter_bypass(fcc);
+			goto out;
+		}
+		e->block = block;
+		e->count = 0;
+		list_add(&e->list, error_bucket(fcc, block));
+		fcc->error_blocks++;
+	}
+	e->count++;
+	e->retry_at = jiffies + min_t(unsigned long, 
+		FC_BACKOFF_MIN << min(e->count - 1, 16U), FC_BACKOFF_MAX);
+out:
+	spin_unlock_irqrestore(&fcc->error_lock, flags);
+}
+
+void block_recovered(struct foolcache_c* fcc, unsigned long block)
+{
+	unsigned long flags;
+	struct fc_error* e;
+	if (likely(fcc->error_blocks == 0)) return;
+
+	spin_lock_irqsave(&fcc->error_lock, flags);
+	e = find_error(fcc, block);
+	if (e)
+	{
+		list_del(&e->list);
+		kfree(e);
+		fcc->error_blocks--;
+	}
+	spin_unlock_irqrestore(&fcc->error_lock, flags);
+}
+
+// whether the block must not be copied now
+static bool block_backoff(struct foolcache_c* fcc, unsigned long block)
+{
+	bool r = false;
+	unsigned long flags;
+	struct fc_error* e;
+	if (likely(fcc->error_blocks == 0)) return false;
+
+	spin_lock_irqsave(&fcc->error_lock, flags);
+	e = find_error(fcc, block);
+	if (e && time_before(jiffies, e->retry_at)) r = true;
+	spin_unlock_irqrestore(&fcc->error_lock, flags);
+	return r;
+}
+
+static void free_errors(struct foolcache_c* fcc)
+{
+	int i;
+	struct fc_error *e, *tmp;
+	for (i=0; i<(1<<FC_ERROR_HASH_BITS); ++i)
+	{
+		list_for_each_entry_safe(e, tmp, &fcc->error_hash[i], list)
+		{
+			list_del(&e->list);
+			kfree(e);
+		}
+	}
+	fcc->error_blocks = 0;
+}
+
+static void init_errors(struct foolcache_c* fcc)
+{
+	int i;
+	spin_lock_init(&fcc->error_lock);
+	for (i=0; i<(1<<FC_ERROR_HASH_BITS); ++i)
+	{
+		INIT_LIST_HEAD(&fcc->error_hash[i]);
+	}
+	fcc->error_threshold = 16;
+	fcc->error_window = 60*HZ;
+	fcc->bypass_recover = 60*HZ;
+	fcc->window_start = jiffies;
+	atomic64_set(&fcc->copy_errors, 0);
+	atomic64_set(&fcc->read_errors, 0);
+}
+
+// drop blocks [start, end] from the cache, blocks being copied are skipped
+int invalidate_blocks(struct foolcache_c* fcc, 
+	unsigned long start, unsigned long end)
+{
+	int r = 0;
+	for (; start<=end; ++start)
+	{
+		if (test_and_set_bit(start, fcc->copying))
+		{
+			r = -EBUSY;
+			continue;
+		}
+		if (test_and_clear_bit(start, fcc->bitmap))
+		{
+			atomic64_dec(&fcc->cached_blocks);
+			bitmap_changed(fcc, start);
+		}
+		drop_partial(fcc, start);
+		end_copying(fcc, start);
+	}
+	return r;
+}
+
+static void retry_read_callback(unsigned long error, void* context)
+{
+	struct fc_io* io = context;
+	struct bio* bio = io->bio;
+	if (!error)
+	{
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+	}
+	bio_endio(bio, unlikely(error) ? -EIO : 0);
+}
+
+/*
+ * Reads that failed on the cache are served again from origin, and their
+ * blocks are dropped from the cache and copied again.
+ */
+static void retry_reads(struct work_struct* work)
+{
+	struct foolcache_c* fcc = container_of(work, struct foolcache_c, retry_work);
+	struct fc_io *io, *tmp;
+	unsigned long flags, start, end;
+	struct dm_io_region region;
+	struct dm_io_request io_req;
+	LIST_HEAD(reads);
+
+	spin_lock_irqsave(&fcc->error_lock, flags);
+	list_splice_init(&fcc->failed_reads, &reads);
+	spin_unlock_irqrestore(&fcc->error_lock, flags);
+
+	list_for_each_entry_safe(io, tmp, &reads, list)
+	{
+		list_del(&io->list);
+		start = sector2block(fcc, io->sector);
+		end = sector2block(fcc, io->sector + io->size/512 - 1);
+		invalidate_blocks(fcc, start, end);
+		hydrate_blocks(fcc, start, end, FC_IO_HYDRATE);
+
+		io->bio->bi_sector = io->sector;
+		io->bio->bi_size = io->size;
+		io->bio->bi_idx = io->idx;
+		io->bio->bi_bdev = fcc->origin->bdev;
+		region.bdev = fcc->origin->bdev;
+		region.sector = io->sector;
+		region.count = io->size/512;
+		io_req.bi_rw = READ;
+		io_req.mem.type = DM_IO_BVEC;
+		io_req.mem.ptr.bvec = io->bio->bi_io_vec + io->idx;
+		io_req.notify.fn = retry_read_callback;
+		io_req.notify.context = io;
+		io_req.client = fcc->io_client;
+		dm_io(&io_req, 1, &region, NULL);
+	}
+}
+
+// called from end_io, returns whether the bio will be retried
+static bool cache_read_failed(struct foolcache_c* fcc, struct fc_io* io)
+{
+	unsigned long flags;
+	if (!io->from_cache || io->retried) return false;
+
+	io->retried = 1;
+	atomic64_inc(&fcc->read_errors);
+	spin_lock_irqsave(&fcc->error_lock, flags);
+	count_error(fcc);
+	list_add_tail(&io->list, &fcc->failed_reads);
+	spin_unlock_irqrestore(&fcc->error_lock, flags);
+	schedule_work(&fcc->retry_work);
+	return true;
+}
+
+static void do_copy_async(struct job_kcopyd* job);
+
+static inline s64 fc_class_bw_rate(struct fc_class* c)
+{
+	return (s64)c->bandwidth * (1024/512);	// sectors per second
+}
+
+// refill the token buckets, allowing a burst of at most one second
+static void fc_sched_refill(struct fc_sched* s)
+{
+	int i;
+	unsigned long now = jiffies;
+	unsigned long elapsed = min_t(unsigned long, now - s->last_refill, HZ);
+	if (elapsed == 0) return;
+
+	s->last_refill = now;
+	for (i=0; i<FC_IO_CLASSES; ++i)
+	{
+		struct fc_class* c = &s->classes[i];
+		if (c->iops)
+		{
+			c->iops_tokens = min_t(s64, c->iops_tokens + 
+				(s64)c->iops * elapsed, (s64)c->iops * HZ);
+		}
+		if (c->bandwidth)
+		{
+			c->bw_tokens = min_t(s64, c->bw_tokens + 
+				fc_class_bw_rate(c) * elapsed, fc_class_bw_rate(c) * HZ);
+		}
+	}
+}
+
+// jiffies until a rate-limited class may dispatch again
+static unsigned long fc_class_delay(struct fc_class* c)
+{
+	unsigned long d = 1;
+	if (c->iops && c->iops_tokens < 0)
+	{
+		d = max_t(unsigned long, d, 
+			div64_u64(-c->iops_tokens, c->iops) + 1);
+	}
+	if (c->bandwidth && c->bw_tokens < 0)
+	{
+		d = max_t(unsigned long, d, 
+			div64_u64(-c->bw_tokens, fc_class_bw_rate(c)) + 1);
+	}
+	return d;
+}
+
+static struct fc_class* fc_sched_pick(struct fc_sched* s, unsigned long* delay)
+{
+	int i;
+	struct fc_class *c, *best = NULL;
+	for (i=0; i<FC_IO_CLASSES; ++i)
+	{
+		c = &s->classes[i];
+		if (c->queued == 0) continue;
+		if (c->max_inflight && c->inflight >= c->max_inflight) continue;
+		if ((c->iops && c->iops_tokens < 0) || (c->bandwidth && c->bw_tokens < 0))
+		{	// over its cap, retry when the bucket is refilled
+			*delay = min(*delay, fc_class_delay(c));
+			continue;
+		}
+		if (s->policy == FC_SCHED_STRICT) return c;
+		if (best == NULL || c->pass < best->pass) best = c;
+	}
+	return best;
+}
+
+static struct job_kcopyd* fc_sched_next(struct foolcache_c* fcc)
+{
+	unsigned long flags, delay = ULONG_MAX;
+	struct fc_sched* s = &fcc->sched;
+	struct job_kcopyd* job = NULL;
+	struct fc_class* c;
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (s->inflight >= s->max_inflight) goto out;
+
+	fc_sched_refill(s);
+	c = fc_sched_pick(s, &delay);
+	if (c == NULL)
+	{
+		if (delay != ULONG_MAX) mod_timer(&s->timer, jiffies + delay);
+		goto out;
+	}
+
+	job = list_first_entry(&c->queue, struct job_kcopyd, list);
+	list_del(&job->list);
+	c->queued--;
+	c->inflight++;
+	c->dispatched++;
+	s->inflight++;
+	if (c->iops) c->iops_tokens -= HZ;
+	if (c->bandwidth) c->bw_tokens -= (s64)job->origin.count * HZ;
+	s->vtime = c->pass;
+	c->pass += FC_SCHED_STRIDE / max(c->weight, 1U);
+
+out:
+	spin_unlock_irqrestore(&s->lock, flags);
+	return job;
+}
+
+void fc_sched_dispatch(struct foolcache_c* fcc)
+{
+	struct job_kcopyd* job;
+	while ((job = fc_sched_next(fcc)) != NULL)
+	{
+		do_copy_async(job);
+	}
+}
+
+static inline sector_t block_sectors(struct foolcache_c* fcc, 
+	unsigned long block)
+{
+	return min_t(sector_t, fcc->block_size, 
+		fcc->sectors - block2sector(fcc, block));
+}
+
+// the job is to copy count sectors from sector, within job->copying_block
+static void set_copy_region(struct job_kcopyd* job, sector_t sector, 
+	sector_t count)
+{
+	struct foolcache_c* fcc = job->fcc;
+	job->origin.bdev = fcc->origin->bdev;
+	job->cache.bdev = fcc->cache->bdev;
+	job->origin.sector = job->cache.sector = sector;
+	job->origin.count = job->cache.count = count;
+}
+
+static inline void set_block_region(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	set_copy_region(job, block2sector(fcc, job->copying_block), 
+		block_sectors(fcc, job->copying_block));
+}
+
+static void fc_sched_submit(struct job_kcopyd* job)
+{
+	bool deferred;
+	unsigned long flags;
+	struct foolcache_c* fcc = job->fcc;
+	struct fc_sched* s = &fcc->sched;
+	struct fc_class* c = &s->classes[job->cls];
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (c->queued++ == 0)
+	{	// don't let an idle class catch up by starving the others
+		c->pass = max(c->pass, s->vtime);
+	}
+	list_add_tail(&job->list, &c->queue);
+	deferred = c->queued > 1 || s->inflight >= s->max_inflight ||
+		(c->max_inflight && c->inflight >= c->max_inflight) ||
+		(c->iops && c->iops_tokens < 0) || (c->bandwidth && c->bw_tokens < 0);
+	if (deferred)
+	{
+		trace_foolcache_defer(fc_dev(fcc), job->copying_block, job->cls, 
+			c->queued, s->inflight);
+	}
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	fc_sched_dispatch(fcc);
+}
+
+static void fc_sched_complete(struct job_kcopyd* job)
+{
+	unsigned long flags;
+	struct foolcache_c* fcc = job->fcc;
+	struct fc_sched* s = &fcc->sched;
+
+	spin_lock_irqsave(&s->lock, flags);
+	s->classes[job->cls].inflight--;
+	s->inflight--;
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	fc_sched_dispatch(fcc);
+}
+
+static void fc_sched_timer_fn(unsigned long data)
+{
+	struct foolcache_c* fcc = (struct foolcache_c*)data;
+	schedule_work(&fcc->sched.work);
+}
+
+static void fc_sched_work_fn(struct work_struct* work)
+{
+	struct foolcache_c* fcc = container_of(work, struct foolcache_c, sched.work);
+	fc_sched_dispatch(fcc);
+}
+
+static void fc_sched_init(struct foolcache_c* fcc)
+{
+	static const unsigned int max_inflight[FC_IO_CLASSES] = {0, 16, 8};
+	static const unsigned int weight[FC_IO_CLASSES] = {8, 2, 1};
+	struct fc_sched* s = &fcc->sched;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	spin_lock_init(&s->lock);
+	for (i=0; i<FC_IO_CLASSES; ++i)
+	{
+		INIT_LIST_HEAD(&s->classes[i].queue);
+		s->classes[i].max_inflight = max_inflight[i];
+		s->classes[i].weight = weight[i];
+	}
+	s->policy = FC_SCHED_STRICT;
+	s->max_inflight = FC_MAX_COPY_JOBS;
+	s->last_refill = jiffies;
+	setup_timer(&s->timer, fc_sched_timer_fn, (unsigned long)fcc);
+	INIT_WORK(&s->work, fc_sched_work_fn);
+	INIT_LIST_HEAD(&s->stopped);
+}
+
+// a background job is done, the last job walking a log frees it
+static void free_job(struct job_kcopyd* job)
+{
+	struct fc_replay* rp = job->replay;
+	if (rp && atomic_dec_and_test(&rp->lanes))
+	{
+		vfree(rp->blocks);
+		kfree(rp);
+	}
+	kfree(job);
+}
+
+/*
+ * A background job stopped by a suspend is kept until the resume, with
+ * copying_block the next block to copy, -1 for none; one stopped by the
+ * bypass mode is dropped.
+ */
+static void stop_job(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	unsigned long flags;
+	if (fcc->bypassing || !fcc->suspended)
+	{
+		free_job(job);
+		return;
+	}
+	spin_lock_irqsave(&fcc->sched.lock, flags);
+	list_add_tail(&job->list, &fcc->sched.stopped);
+	spin_unlock_irqrestore(&fcc->sched.lock, flags);
+}
+
+// take queued background jobs off, returns the number of jobs still queued
+static unsigned int fc_sched_drain(struct foolcache_c* fcc)
+{
+	int i;
+	unsigned int left = 0;
+	unsigned long flags;
+	struct fc_sched* s = &fcc->sched;
+	struct job_kcopyd *job, *tmp;
+	LIST_HEAD(dropped);
+
+	spin_lock_irqsave(&s->lock, flags);
+	for (i=0; i<FC_IO_CLASSES; ++i)
+	{
+		struct fc_class* c = &s->classes[i];
+		list_for_each_entry_safe(job, tmp, &c->queue, list)
+		{
+			if (job->bio) continue;
+			list_move_tail(&job->list, &dropped);
+			c->queued--;
+		}
+		left += c->queued;
+	}
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	list_for_each_entry_safe(job, tmp, &dropped, list)
+	{	// copied again after the resume
+		end_copying(fcc, job->copying_block);
+		stop_job(job);
+	}
+	return left;
+}
+
+// stop background copying, called when the target is suspended
+void fc_sched_quiesce(struct foolcache_c* fcc)
+{
+	fcc->suspended = 1;
+	smp_mb();
+	do {
+		if (fc_sched_drain(fcc) && !atomic_read(&fcc->kcopyd_jobs))
+		{	// only misses held by the rate limit, until its timer
+			msleep(10);
+		}
+		while (atomic_read(&fcc->kcopyd_jobs))
+		{
+			msleep(10);
+		}
+		flush_workqueue(fcc->done_wq);
+	} while (fc_sched_drain(fcc) || atomic_read(&fcc->kcopyd_jobs));
+	del_timer_sync(&fcc->sched.timer);
+	cancel_work_sync(&fcc->sched.work);
+}
+
+// whether a background job is to copy the block, it is then being copied
+static bool start_background_copy(struct foolcache_c* fcc, unsigned long block)
+{
+	if (test_bit(block, fcc->bitmap) || block_backoff(fcc, block) ||
+		test_and_set_bit(block, fcc->copying))
+		return false;
+	if (test_bit(block, fcc->bitmap))
+	{	// copied by someone else in the meantime
+		end_copying(fcc, block);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Background jobs walk [copying_block, end_block] with a step of stride,
+ * copying every block that is neither cached nor being copied already.
+ */
+static void hydrate_async(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	unsigned long block = job->copying_block;
+	for (; block <= job->end_block; block += job->stride)
+	{
+		if (fcc->bypassing || fcc->suspended)
+		{
+			job->copying_block = block;
+			stop_job(job);
+			return;
+		}
+		if (!start_background_copy(fcc, block))
+			continue;
+		job->copying_block = block;
+		set_block_region(job);
+		fc_sched_submit(job);
+		return;
+	}
+	free_job(job);
+}
+
+/*
+ * Replay jobs share a cursor into the log, so blocks are copied in the order
+ * they were first read, by as many jobs as there are lanes.
+ */
+static void replay_async(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	struct fc_replay* rp = job->replay;
+	unsigned long i, block;
+	while (1)
+	{
+		if (fcc->bypassing || fcc->suspended)
+		{
+			job->copying_block = -1;
+			stop_job(job);
+			return;
+		}
+		i = atomic_inc_return(&rp->next) - 1;
+		if (i >= rp->count) break;
+		block = rp->blocks[i];
+		atomic64_inc(&fcc->prewarm_done);
+		if (block > last_caching_block(fcc) || !start_background_copy(fcc, block))
+			continue;
+		job->copying_block = block;
+		set_block_region(job);
+		fc_sched_submit(job);
+		return;
+	}
+	free_job(job);
+}
+
+// background copying goes on where the suspend stopped it
+void fc_sched_resume(struct foolcache_c* fcc)
+{
+	unsigned long flags;
+	struct job_kcopyd *job, *tmp;
+	LIST_HEAD(stopped);
+
+	fcc->suspended = 0;
+	smp_mb();
+	spin_lock_irqsave(&fcc->sched.lock, flags);
+	list_splice_init(&fcc->sched.stopped, &stopped);
+	spin_unlock_irqrestore(&fcc->sched.lock, flags);
+
+	list_for_each_entry_safe(job, tmp, &stopped, list)
+	{
+		list_del(&job->list);
+		if (job->replay == NULL)
+		{
+			hydrate_async(job);
+		}
+		else if (job->copying_block != -1 && 
+			start_background_copy(fcc, job->copying_block))
+		{	// the block it had taken from the log
+			set_block_region(job);
+			fc_sched_submit(job);
+		}
+		else
+		{
+			replay_async(job);
+		}
+	}
+}
+
+// background jobs stopped by the last suspend, when the target goes away
+static void free_stopped_jobs(struct foolcache_c* fcc)
+{
+	struct job_kcopyd *job, *tmp;
+	list_for_each_entry_safe(job, tmp, &fcc->sched.stopped, list)
+	{
+		list_del(&job->list);
+		free_job(job);
+	}
+}
+
+#define FC_HYDRATE_LANES 8
+
+// copy blocks [start, end] in the background, in class cls
+int hydrate_blocks(struct foolcache_c* fcc, unsigned long start, 
+	unsigned long end, unsigned int cls)
+{
+	unsigned int i, lanes;
+	struct fc_class* c = &fcc->sched.classes[cls];
+	if (fcc->bypassing || fcc->suspended) return 0;
+
+	lanes = c->max_inflight ? c->max_inflight : FC_HYDRATE_LANES;
+	lanes = min_t(unsigned long, lanes, end - start + 1);
+	for (i=0; i<lanes; ++i)
+	{
+		struct job_kcopyd* job = kmalloc(sizeof(*job), GFP_NOIO);
+		if (job == NULL) return -ENOMEM;
+		job->bio = NULL;
+		job->fcc = fcc;
+		job->io = NULL;
+		job->replay = NULL;
+		job->cpu = raw_smp_processor_id();
+		job->cls = cls;
+		job->copying_block = start + i;
+		job->end_block = end;
+		job->stride = lanes;
+		hydrate_async(job);
+	}
+	return 0;
+}
+
+// copy the blocks of a log in the background, in order; takes the log over
+int prewarm_blocks(struct foolcache_c* fcc, u32* blocks, unsigned long count)
+{
+	unsigned int i, lanes;
+	struct fc_replay* rp;
+	struct fc_class* c = &fcc->sched.classes[FC_IO_READAHEAD];
+	if (count == 0 || fcc->bypassing || fcc->suspended)
+	{
+		vfree(blocks);
+		return 0;
+	}
+
+	rp = kmalloc(sizeof(*rp), GFP_KERNEL);
+	if (rp == NULL)
+	{
+		vfree(blocks);
+		return -ENOMEM;
+	}
+	rp->blocks = blocks;
+	rp->count = count;
+	atomic_set(&rp->next, 0);
+	atomic_set(&rp->lanes, 1);		// until every lane is started
+	atomic64_add(count, &fcc->prewarm_total);
+
+	lanes = c->max_inflight ? c->max_inflight : FC_HYDRATE_LANES;
+	lanes = min_t(unsigned long, lanes, count);
+	for (i=0; i<lanes; ++i)
+	{
+		struct job_kcopyd* job = kmalloc(sizeof(*job), GFP_KERNEL);
+		if (job == NULL) break;
+		job->bio = NULL;
+		job->fcc = fcc;
+		job->io = NULL;
+		job->replay = rp;
+		job->cpu = raw_smp_processor_id();
+		job->cls = FC_IO_READAHEAD;
+		job->stride = 1;
+		atomic_inc(&rp->lanes);
+		replay_async(job);
+	}
+	if (atomic_dec_and_test(&rp->lanes))
+	{
+		vfree(rp->blocks);
+		kfree(rp);
+	}
+	return i ? 0 : -ENOMEM;
+}
+
+static void readahead_async(struct foolcache_c* fcc, unsigned long block)
+{
+	unsigned long start = block + 1;
+	unsigned long end = min_t(unsigned long, block + fcc->readahead, 
+		last_caching_block(fcc));
+	if (start > end || find_next_zero_bit(fcc->bitmap, end + 1, start) > end)
+		return;
+	hydrate_blocks(fcc, start, end, FC_IO_READAHEAD);
+}
+
+static int ensure_block_async(struct job_kcopyd* job);
+
+// log the blocks of [start, end] that are accessed for the first time
+static void record_access(struct foolcache_c* fcc, 
+	unsigned long start, unsigned long end)
+{
+	unsigned int i;
+	for (; start<=end; ++start)
+	{
+		if (test_bit(start, fcc->accessed) || 
+			test_and_set_bit(start, fcc->accessed))
+			continue;
+		i = atomic_inc_return(&fcc->trace_len) - 1;
+		if (i >= fcc->trace_cap)
+		{	// the log is full
+			fcc->recording = 0;
+			return;
+		}
+		fcc->trace[i] = start;
+	}
+}
+
+// job->copying_block is in cache, move on to the next block of the bio
+static void next_block_async(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	unsigned long block = find_next_copying_block(fcc, job->bio, 
+		job->copying_block + 1, job->end_block);
+	if (block == -1)
+	{
+		do_read_async(job, fcc->cache);
+		return;
+	}
+	job->copying_block = block;
+	ensure_block_async(job);
+}
+
+// the copied sectors are valid, returns whether the whole block is
+static bool copy_completes_block(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	unsigned long block = job->copying_block;
+	unsigned long flags, first;
+	bool complete = false;
+	struct fc_partial* p;
+
+	if (job->origin.count == block_sectors(fcc, block))
+	{
+		drop_partial(fcc, block);
+		return true;
+	}
+
+	first = (job->origin.sector - block2sector(fcc, block)) >> fcc->subblock_shift;
+	spin_lock_irqsave(&fcc->partial_lock, flags);
+	p = find_partial(fcc, block);
+	if (p)
+	{
+		bitmap_set(p->bits, first, 
+			DIV_ROUND_UP(job->origin.count, 1 << fcc->subblock_shift));
+		complete = find_first_zero_bit(p->bits, fcc->subblocks) >= fcc->subblocks;
+	}
+	spin_unlock_irqrestore(&fcc->partial_lock, flags);
+	if (complete) drop_partial(fcc, block);
+	return complete;
+}
+
+// the copy of a job is done, on the done workqueue
+static void ensure_block_done(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	unsigned long block = job->copying_block;
+	bool failed = job->error != 0;
+
+	if (unlikely(failed))
+	{
+		atomic64_inc(&fcc->copy_errors);
+		block_failed(fcc, block);
+	}
+	else
+	{
+		block_recovered(fcc, block);
+		if (copy_completes_block(job))
+		{
+			set_bit(block, fcc->bitmap);
+			bitmap_changed(fcc, block);
+			atomic64_inc(&fcc->cached_blocks);
+		}
+		this_cpu_add(fcc->stats->bytes_copied, job->origin.count * 512);
+	}
+	end_copying(fcc, block);
+
+	if (job->bio == NULL)
+	{
+		if (job->replay)
+		{
+			replay_async(job);
+			return;
+		}
+		job->copying_block = block + job->stride;
+		hydrate_async(job);
+		return;
+	}
+
+	if (unlikely(failed) || fcc->bypassing)
+	{	// serve this bio from origin
+		do_read_async(job, fcc->origin);
+		return;
+	}
+	next_block_async(job);
+}
+
+// hand a job over to the done workqueue, on the cpu it was issued from
+static void queue_done(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	int cpu = cpu_online(job->cpu) ? job->cpu : raw_smp_processor_id();
+	struct fc_done* d = per_cpu_ptr(fcc->done, cpu);
+	unsigned long flags;
+	bool first;
+
+	spin_lock_irqsave(&d->lock, flags);
+	first = list_empty(&d->jobs);
+	list_add_tail(&job->list, &d->jobs);
+	spin_unlock_irqrestore(&d->lock, flags);
+	if (first)
+	{	// otherwise the work is queued, and yet to take the list
+		queue_work_on(cpu, fcc->done_wq, &d->work);
+	}
+}
+
+static inline struct fc_waitq* wait_bucket(struct foolcache_c* fcc, 
+	unsigned long block)
+{
+	return &fcc->waiters[hash_long(block, FC_WAIT_HASH_BITS)];
+}
+
+// queue the jobs of a bucket parked on the block, or all of them
+static void wake_bucket(struct foolcache_c* fcc, struct fc_waitq* q, 
+	unsigned long block, bool all)
+{
+	unsigned long flags;
+	struct job_kcopyd *job, *tmp;
+	LIST_HEAD(woken);
+
+	spin_lock_irqsave(&q->lock, flags);
+	list_for_each_entry_safe(job, tmp, &q->jobs, list)
+	{
+		if (all || job->copying_block == block)
+		{
+			list_move_tail(&job->list, &woken);
+			atomic_dec(&fcc->parked);
+		}
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	list_for_each_entry_safe(job, tmp, &woken, list)
+	{
+		list_del(&job->list);
+		job->parked = true;
+		queue_done(job);
+	}
+}
+
+// the copy of the block has ended, called by end_copying()
+void wake_waiters(struct foolcache_c* fcc, unsigned long block)
+{
+	wake_bucket(fcc, wait_bucket(fcc, block), block, false);
+}
+
+// wait, without blocking, for the copy of job->copying_block by someone else
+static void park_job(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	unsigned long flags, block = job->copying_block;
+	struct fc_waitq* q = wait_bucket(fcc, block);
+	bool first;
+
+	spin_lock_irqsave(&q->lock, flags);
+	list_add_tail(&job->list, &q->jobs);
+	first = atomic_inc_return(&fcc->parked) == 1;
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (first)
+	{
+		mod_timer(&fcc->wait_timer, jiffies + fcc->wait_timeout);
+	}
+
+	smp_mb();	// pairs with end_copying()
+	if (!test_bit(block, fcc->copying))
+	{	// the copy ended before the job was parked
+		wake_waiters(fcc, block);
+	}
+}
+
+static void fc_wait_timer_fn(unsigned long data)
+{
+	struct foolcache_c* fcc = (struct foolcache_c*)data;
+	schedule_work(&fcc->wait_work);
+}
+
+// while jobs are parked, claims may expire, or the cache be bypassed
+static void fc_wait_work_fn(struct work_struct* work)
+{
+	int i;
+	struct foolcache_c* fcc = container_of(work, struct foolcache_c, wait_work);
+	atomic64_set(&fcc->ts, get_jiffies_64());
+	expire_claims(fcc, false);
+	if (fcc->bypassing)
+	{	// to be served from origin
+		for (i=0; i<(1<<FC_WAIT_HASH_BITS); ++i)
+		{
+			wake_bucket(fcc, &fcc->waiters[i], 0, true);
+		}
+	}
+	if (atomic_read(&fcc->parked))
+	{
+		mod_timer(&fcc->wait_timer, jiffies + fcc->wait_timeout);
+	}
+}
+
+// a parked job is woken up, the copy it waited for has ended
+static void resume_job(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	unsigned long block = job->copying_block;
+	if (fcc->bypassing)
+	{
+		trace_foolcache_wait_end(fc_dev(fcc), block);
+		do_read_async(job, fcc->origin);
+		return;
+	}
+	if (test_bit(block, fcc->copying))
+	{	// being copied again
+		park_job(job);
+		return;
+	}
+	trace_foolcache_wait_end(fc_dev(fcc), block);
+	if (!test_bit(block, fcc->bitmap))
+	{	// the copy failed, or was of other sub-blocks: start over
+		atomic64_dec(&fcc->hits);
+		atomic64_inc(&fcc->misses);
+		ensure_block_async(job);
+		return;
+	}
+	next_block_async(job);
+}
+
+// copies done and waits ended on a cpu, taken in a batch
+static void fc_done_work(struct work_struct* work)
+{
+	struct fc_done* d = container_of(work, struct fc_done, work);
+	struct foolcache_c* fcc = d->fcc;
+	struct job_kcopyd *job, *tmp;
+	struct blk_plug plug;
+	unsigned long flags;
+	LIST_HEAD(jobs);
+
+	spin_lock_irqsave(&d->lock, flags);
+	list_splice_init(&d->jobs, &jobs);
+	spin_unlock_irqrestore(&d->lock, flags);
+
+	blk_start_plug(&plug);	// reads of the cache are submitted together
+	list_for_each_entry_safe(job, tmp, &jobs, list)
+	{
+		list_del(&job->list);
+		if (job->parked)
+		{
+			resume_job(job);
+			continue;
+		}
+		if (job->fetch)
+		{	// a shared copy, completed here out of interrupt context
+			trace_foolcache_copy_end(fc_dev(fcc), job->copying_block, 
+				job->origin.sector, job->origin.count, job->cls, job->error);
+			fc_sched_complete(job);
+			fc_fetch_put(job->fetch);
+			job->fetch = NULL;
+		}
+		atomic_dec(&fcc->kcopyd_jobs);
+		ensure_block_done(job);
+	}
+	blk_finish_plug(&plug);
+}
+
+// a copy not made by kcopyd has ended, maybe in interrupt context
+void fc_copy_ended(struct job_kcopyd* job, int error)
+{
+	job->error = error;
+	job->parked = false;
+	queue_done(job);
+}
+
+// kcopyd callback, the copy is left to the done workqueue
+static void ensure_block_async_callback(int read_err, 
+	unsigned long write_err, void *context)
+{
+	struct job_kcopyd* job = context;
+	job->error = (read_err || write_err) ? -EIO : 0;
+	job->parked = false;
+	trace_foolcache_copy_end(fc_dev(job->fcc), job->copying_block, 
+		job->origin.sector, job->origin.count, job->cls, job->error);
+	fc_sched_complete(job);
+	queue_done(job);
+}
+
+static void do_copy_async(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	atomic_inc(&fcc->kcopyd_jobs);
+	trace_foolcache_copy_start(fc_dev(fcc), job->copying_block, 
+		job->origin.sector, job->origin.count, job->cls, 0);
+	job->fetch = NULL;
+	if (fcc->shared && fc_shared_copy(job) == 0)
+		return;
+	dm_kcopyd_copy(fcc->kcopyd_client, &job->origin, 1, &job->cache, 
+		0, ensure_block_async_callback, job);
+}
+
+/*
+ * Sets the region of a miss: the whole block, or with sub-blocks, the span of
+ * those the bio reads that are not valid yet. Returns false if there is none.
+ */
+static bool set_miss_region(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	unsigned long block = job->copying_block;
+	unsigned long flags, first, last;
+	sector_t start = block2sector(fcc, block);
+	struct fc_partial* p;
+
+	if (fcc->subblock_shift == 0 || (p = get_partial(fcc, block)) == NULL)
+	{	// no sub-blocks, or too many partial blocks
+		set_block_region(job);
+		return true;
+	}
+
+	bio_subblocks(fcc, job->bio, block, &first, &last);
+	spin_lock_irqsave(&fcc->partial_lock, flags);
+	first = find_next_zero_bit(p->bits, last + 1, first);
+	while (last > first && test_bit(last, p->bits)) last--;
+	spin_unlock_irqrestore(&fcc->partial_lock, flags);
+	if (first > last) return false;
+
+	start += first << fcc->subblock_shift;
+	set_copy_region(job, start, min_t(sector_t, 
+		(last - first + 1) << fcc->subblock_shift, fcc->sectors - start));
+	return true;
+}
+
+static int ensure_block_async(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	unsigned long block = job->copying_block;
+	if (fcc->bypassing || block_backoff(fcc, block))
+	{
+		do_read_async(job, fcc->origin);
+		return 0;
+	}
+
+	// before copying
+	if (test_and_set_bit(block, fcc->copying))
+	{	// the block is being copied by another thread, let's just wait
+		atomic64_inc(&fcc->hits);		// it's really a hit, 
+		atomic64_dec(&fcc->misses);		// instead of a miss
+		job->io->path = FC_PATH_WAIT;
+		trace_foolcache_wait_start(fc_dev(fcc), block);
+		park_job(job);
+		return 0;
+	}
+
+	if (test_bit(block, fcc->bitmap))
+	{
+		atomic64_inc(&fcc->hits);		// it's really a hit, 
+		atomic64_dec(&fcc->misses);		// instead of a miss
+		end_copying(fcc, block);
+		next_block_async(job);
+		return 0;
+	}
+
+	if (!set_miss_region(job))
+	{	// copied by a miss of the same sub-blocks in the meantime
+		atomic64_inc(&fcc->hits);
+		atomic64_dec(&fcc->misses);
+		end_copying(fcc, block);
+		next_block_async(job);
+		return 0;
+	}
+
+	// do copying, foreground misses are served first by the scheduler
+	job->cls = FC_IO_MISS;
+	fc_sched_submit(job);
+	return 0;
+}
+
+int map_async(struct foolcache_c* fcc, struct bio* bio, 
+	union map_info* map_context)
+{
+	struct fc_io* io;
+	sector_t last_sector;
+	unsigned long now = jiffies, last = READ_ONCE(fcc->bitmap_last_sync);
+	if (fcc->flush_interval && READ_ONCE(fcc->bitmap_modified) &&
+		time_after(now, last + fcc->flush_interval) &&
+		cmpxchg(&fcc->bitmap_last_sync, last, now) == last)
+	{	// by one bio of those that see it due
+		write_bitmap(fcc, write_bitmap_callback);
+	}
+	if (unlikely(fcc->bypassing) && fcc->bypass_recover && 
+		time_after(now, fcc->bypass_until))
+	{
+		leave_bypass(fcc);
+	}
+
+	if (bio_data_dir(bio) == WRITE)
+	{
+		return -EIO;
+	}
+
+	io = mempool_alloc(fcc->io_pool, GFP_NOIO);
+	io->start = ktime_get();
+	io->from_cache = io->retried = 0;
+	io->bio = bio;
+	io->sector = bio->bi_sector;
+	io->size = bio->bi_size;
+	io->idx = bio->bi_idx;
+	map_context->ptr = io;
+
+	last_sector = bio->bi_sector + bio->bi_size/512 - 1;
+	if (unlikely(fcc->recording) && last_sector <= fcc->last_caching_sector)
+	{
+		record_access(fcc, sector2block(fcc, bio->bi_sector), 
+			sector2block(fcc, last_sector));
+	}
+	if (unlikely(fcc->bypassing || last_sector > fcc->last_caching_sector))
+	{
+		unsigned long blocks = sector2block(fcc, last_sector) - sector2block(fcc, bio->bi_sector) + 1;
+		atomic64_add(blocks, &fcc->misses);
+		io->path = FC_PATH_BYPASS;
+		trace_foolcache_map(fc_dev(fcc), bio->bi_sector, bio->bi_size, FC_MAP_BYPASS);
+		bio->bi_bdev = fcc->origin->bdev;
+		return DM_MAPIO_REMAPPED;
+	}
+	else
+	{	// preparing the cache, followed by remapping
+		struct job_kcopyd* job;
+		unsigned long end_block = sector2block(fcc, last_sector);
+		unsigned long start_block = sector2block(fcc, bio->bi_sector);
+		start_block = find_next_copying_block(fcc, bio, start_block, end_block);
+
+		if (start_block == -1)
+		{	//all blocks are hit
+			io->path = FC_PATH_HIT;
+			io->from_cache = 1;
+			trace_foolcache_map(fc_dev(fcc), bio->bi_sector, bio->bi_size, FC_MAP_HIT);
+			bio->bi_bdev = fcc->cache->bdev;
+			return DM_MAPIO_REMAPPED;
+		}
+
+		job = kmalloc(sizeof(*job), GFP_NOIO);
+		if (job == NULL)
+		{	// no memory for a copy job, serve it from origin
+			io->path = FC_PATH_BYPASS;
+			trace_foolcache_map(fc_dev(fcc), bio->bi_sector, bio->bi_size, FC_MAP_BYPASS);
+			bio->bi_bdev = fcc->origin->bdev;
+			return DM_MAPIO_REMAPPED;
+		}
+		job->copying_block = start_block;
+		job->end_block = end_block;
+		job->bio = bio;
+		job->fcc = fcc;
+		job->io = io;
+		job->replay = NULL;
+		job->cpu = raw_smp_processor_id();
+		io->path = FC_PATH_MISS;
+		trace_foolcache_map(fc_dev(fcc), bio->bi_sector, bio->bi_size, FC_MAP_MISS);
+		ensure_block_async(job);
+		if (fcc->readahead)
+		{
+			readahead_async(fcc, end_block);
+		}
+		return DM_MAPIO_SUBMITTED;
+	}
+}
+
+int fc_end_io(struct foolcache_c* fcc, struct fc_io* io, int error)
+{
+	if (unlikely(error) && io && cache_read_failed(fcc, io))
+	{	// to be served again from origin
+		return DM_ENDIO_INCOMPLETE;
+	}
+	if (io)
+	{
+		fc_stats_account(fcc, io->path, io->start);
+		mempool_free(io, fcc->io_pool);
+	}
+	return error;
+}
+
+// the target's devices, clients and bitmaps are set up by the caller
+int fc_core_init(struct foolcache_c* fcc)
+{
+	int i, cpu;
+	u64 gen;
+	fcc->done_wq = alloc_workqueue("foolcache", WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	fcc->done = alloc_percpu(struct fc_done);
+	if (fcc->done_wq == NULL || fcc->done == NULL)
+	{
+		if (fcc->done_wq) destroy_workqueue(fcc->done_wq);
+		if (fcc->done) free_percpu(fcc->done);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+	{
+		struct fc_done* d = per_cpu_ptr(fcc->done, cpu);
+		spin_lock_init(&d->lock);
+		INIT_LIST_HEAD(&d->jobs);
+		INIT_WORK(&d->work, fc_done_work);
+		d->fcc = fcc;
+	}
+	for (i=0; i<(1<<FC_WAIT_HASH_BITS); ++i)
+	{
+		spin_lock_init(&fcc->waiters[i].lock);
+		INIT_LIST_HEAD(&fcc->waiters[i].jobs);
+	}
+	atomic_set(&fcc->parked, 0);
+	setup_timer(&fcc->wait_timer, fc_wait_timer_fn, (unsigned long)fcc);
+	INIT_WORK(&fcc->wait_work, fc_wait_work_fn);
+
+	atomic_set(&fcc->kcopyd_jobs, 0);
+	fc_sched_init(fcc);
+	init_errors(fcc);
+	INIT_LIST_HEAD(&fcc->failed_reads);
+	INIT_WORK(&fcc->retry_work, retry_reads);
+	spin_lock_init(&fcc->claim_lock);
+	INIT_LIST_HEAD(&fcc->claims);
+	spin_lock_init(&fcc->partial_lock);
+	for (i=0; i<(1<<FC_PARTIAL_HASH_BITS); ++i)
+	{
+		INIT_LIST_HEAD(&fcc->partial_hash[i]);
+	}
+	INIT_LIST_HEAD(&fcc->partial_lru);
+	fcc->partial_blocks = 0;
+	fcc->max_partial_blocks = FC_MAX_PARTIAL_BLOCKS;
+	atomic64_set(&fcc->hits, 0);
+	atomic64_set(&fcc->misses, 0);
+	// above what an earlier instance of the table may have handed out
+	gen = ktime_to_ns(ktime_get_real());
+	atomic64_set(&fcc->generation, gen);
+	atomic_set(&fcc->bitmap_writes, 0);
+	for (i=0; i<DIV_ROUND_UP(fcc->blocks, FOOLCACHE_REGION_BLOCKS); ++i)
+	{
+		fcc->region_gen[i] = gen;
+	}
+	atomic_set(&fcc->trace_len, 0);
+	atomic64_set(&fcc->prewarm_done, 0);
+	atomic64_set(&fcc->prewarm_total, 0);
+	fcc->flush_interval = 16*HZ;
+	fcc->wait_timeout = 1*HZ;
+	return 0;
+}
+
+// wait for copies and retries in flight, the bitmap is left to the caller
+void fc_core_exit(struct foolcache_c* fcc)
+{
+	fc_sched_quiesce(fcc);
+	free_stopped_jobs(fcc);
+	flush_work(&fcc->retry_work);
+	del_timer_sync(&fcc->wait_timer);
+	cancel_work_sync(&fcc->wait_work);
+	destroy_workqueue(fcc->done_wq);
+	free_percpu(fcc->done);
+	free_errors(fcc);
+	expire_claims(fcc, true);
+	free_partials(fcc);
+}
@@ -0,0 +1,327 @@
+/*
+ * Fetches from an origin shared by several foolcache targets: every range
+ * being copied is read once, and written to the cache of each target that
+ * copies it meanwhile.
+ *
+ * This file is released under the GPL.
+ */
+
+#ifdef __KERNEL__
+#include <linux/module.h>
+#endif
+#include "dm-foolcache.h"
+
+unsigned int fc_shared_cache_kb;
+#ifdef __KERNEL__
+module_param_named(shared_cache_kb, fc_shared_cache_kb, uint, 0644);
+MODULE_PARM_DESC(shared_cache_kb,
+	"KB of shared fetches kept in memory after they are done, per origin");
+#endif
+
+static DEFINE_SPINLOCK(fc_origins_lock);
+static LIST_HEAD(fc_origins);
+
+static void free_origin(struct fc_origin* o)
+{
+	struct fc_fetch *f, *tmp;
+	list_for_each_entry_safe(f, tmp, &o->lru, lru)
+	{
+		list_del(&f->lru);
+		list_del(&f->hash);
+		fc_fetch_put(f);
+	}
+	if (o->wq) destroy_workqueue(o->wq);
+	if (o->io_client && !IS_ERR(o->io_client)) dm_io_client_destroy(o->io_client);
+	if (o->page_pool) mempool_destroy(o->page_pool);
+	kfree(o);
+}
+
+// lock held
+static struct fc_origin* find_origin(dev_t dev)
+{
+	struct fc_origin* o;
+	list_for_each_entry(o, &fc_origins, list)
+	{
+		if (o->dev == dev)
+		{	// attached by another target already
+			o->users++;
+			return o;
+		}
+	}
+	return NULL;
+}
+
+// the shared state of an origin, for a target attaching to it
+struct fc_origin* fc_shared_get(struct block_device* bdev)
+{
+	int i;
+	struct fc_origin *o, *n;
+
+	spin_lock(&fc_origins_lock);
+	o = find_origin(bdev->bd_dev);
+	spin_unlock(&fc_origins_lock);
+	if (o) return o;
+
+	n = kzalloc(sizeof(*n), GFP_KERNEL);
+	if (n == NULL) return NULL;
+	n->dev = bdev->bd_dev;
+	n->users = 1;
+	spin_lock_init(&n->lock);
+	for (i=0; i<(1<<FC_FETCH_HASH_BITS); ++i)
+	{
+		INIT_LIST_HEAD(&n->fetches[i]);
+	}
+	INIT_LIST_HEAD(&n->lru);
+	n->wq = alloc_workqueue("foolcache_shared", WQ_MEM_RECLAIM, 0);
+	n->io_client = dm_io_client_create();
+	n->page_pool = mempool_create_page_pool(FC_FETCH_MAX_PAGES, 0);
+	if (n->wq == NULL || IS_ERR(n->io_client) || n->page_pool == NULL)
+	{
+		free_origin(n);
+		return NULL;
+	}
+
+	spin_lock(&fc_origins_lock);
+	o = find_origin(n->dev);
+	if (o)
+	{	// attached meanwhile
+		spin_unlock(&fc_origins_lock);
+		free_origin(n);
+		return o;
+	}
+	list_add(&n->list, &fc_origins);
+	spin_unlock(&fc_origins_lock);
+	return n;
+}
+
+// a target detaches, with no copy in flight
+void fc_shared_put(struct fc_origin* o)
+{
+	bool last;
+	spin_lock(&fc_origins_lock);
+	last = --o->users == 0;
+	if (last) list_del(&o->list);
+	spin_unlock(&fc_origins_lock);
+	if (last) free_origin(o);
+}
+
+static void free_fetch(struct fc_fetch* f)
+{
+	unsigned int i;
+	for (i=0; i<f->nr_pages; ++i)
+	{
+		mempool_free(f->pages[i].page, f->origin->page_pool);
+	}
+	kfree(f);
+}
+
+void fc_fetch_put(struct fc_fetch* f)
+{
+	if (atomic_dec_and_test(&f->refs))
+	{
+		free_fetch(f);
+	}
+}
+
+static inline struct list_head* fetch_bucket(struct fc_origin* o, sector_t sector)
+{
+	return &o->fetches[hash_long((unsigned long)sector, FC_FETCH_HASH_BITS)];
+}
+
+// lock held
+static struct fc_fetch* find_fetch(struct fc_origin* o,
+	sector_t sector, sector_t count)
+{
+	struct fc_fetch* f;
+	list_for_each_entry(f, fetch_bucket(o, sector), hash)
+	{
+		if (f->sector == sector && f->count == count) return f;
+	}
+	return NULL;
+}
+
+static void write_cache_callback(unsigned long error, void* context)
+{
+	struct job_kcopyd* job = context;
+	fc_copy_ended(job, error ? -EIO : 0);
+}
+
+// write the data fetched to the cache of the job
+static void write_cache(struct job_kcopyd* job)
+{
+	struct foolcache_c* fcc = job->fcc;
+	struct dm_io_request io_req;
+
+	io_req.bi_rw = WRITE;
+	io_req.mem.type = DM_IO_PAGE_LIST;
+	io_req.mem.offset = 0;
+	io_req.mem.ptr.pl = job->fetch->pages;
+	io_req.notify.fn = write_cache_callback;
+	io_req.notify.context = job;
+	io_req.client = fcc->io_client;
+	if (dm_io(&io_req, 1, &job->cache, NULL))
+	{
+		fc_copy_ended(job, -EIO);
+	}
+}
+
+// the fetch is read, hand it to the jobs that joined it
+static void fetch_read_work(struct work_struct* work)
+{
+	struct fc_fetch *f = container_of(work, struct fc_fetch, work);
+	struct fc_fetch *g, *tmp;
+	struct fc_origin* o = f->origin;
+	struct job_kcopyd *job, *next;
+	sector_t max_kept = (sector_t)fc_shared_cache_kb * (1024/512);
+	unsigned long flags;
+	LIST_HEAD(jobs);
+	LIST_HEAD(dropped);
+
+	spin_lock_irqsave(&o->lock, flags);
+	f->done = 1;
+	list_splice_init(&f->jobs, &jobs);
+	list_for_each_entry(job, &jobs, list)
+	{
+		atomic_inc(&f->refs);
+	}
+	if (f->error == 0 && f->count <= max_kept)
+	{	// keep it, dropping the least recently used
+		list_add_tail(&f->lru, &o->lru);
+		o->kept += f->count;
+		list_for_each_entry_safe(g, tmp, &o->lru, lru)
+		{
+			if (o->kept <= max_kept) break;
+			list_move(&g->lru, &dropped);
+			list_del(&g->hash);
+			o->kept -= g->count;
+		}
+	}
+	else
+	{
+		list_del(&f->hash);
+		list_add(&f->lru, &dropped);
+	}
+	spin_unlock_irqrestore(&o->lock, flags);
+
+	list_for_each_entry_safe(g, tmp, &dropped, lru)
+	{
+		list_del(&g->lru);
+		fc_fetch_put(g);
+	}
+	list_for_each_entry_safe(job, next, &jobs, list)
+	{
+		list_del(&job->list);
+		if (f->error)
+			fc_copy_ended(job, f->error);
+		else
+			write_cache(job);
+	}
+}
+
+static void fetch_read_callback(unsigned long error, void* context)
+{
+	struct fc_fetch* f = context;
+	f->error = error ? -EIO : 0;
+	queue_work(f->origin->wq, &f->work);
+}
+
+// without waiting for memory, the copy can go through kcopyd instead
+static struct fc_fetch* alloc_fetch(struct fc_origin* o,
+	sector_t sector, sector_t count)
+{
+	unsigned int i, n = DIV_ROUND_UP(count * 512, PAGE_SIZE);
+	struct fc_fetch* f;
+
+	if (n > FC_FETCH_MAX_PAGES) return NULL;
+	f = kmalloc(sizeof(*f) + n * sizeof(struct page_list), GFP_NOIO);
+	if (f == NULL) return NULL;
+	f->origin = o;
+	for (f->nr_pages=0; f->nr_pages<n; ++f->nr_pages)
+	{
+		i = f->nr_pages;
+		f->pages[i].page = mempool_alloc(o->page_pool, GFP_NOWAIT);
+		if (f->pages[i].page == NULL)
+		{
+			free_fetch(f);
+			return NULL;
+		}
+		f->pages[i].next = i + 1 < n ? &f->pages[i + 1] : NULL;
+	}
+	INIT_LIST_HEAD(&f->lru);
+	INIT_LIST_HEAD(&f->jobs);
+	INIT_WORK(&f->work, fetch_read_work);
+	f->sector = sector;
+	f->count = count;
+	f->error = 0;
+	f->done = 0;
+	atomic_set(&f->refs, 1);
+	return f;
+}
+
+/*
+ * Copy job->origin to job->cache through a shared fetch, ends with
+ * fc_copy_ended(). Returns non-zero, if too large or out of memory, to copy
+ * it alone.
+ */
+int fc_shared_copy(struct job_kcopyd* job)
+{
+	struct fc_origin* o = job->fcc->shared;
+	sector_t sector = job->origin.sector, count = job->origin.count;
+	struct fc_fetch *f, *n = NULL;
+	unsigned long flags;
+	bool kept;
+	struct dm_io_region region;
+	struct dm_io_request io_req;
+
+again:
+	spin_lock_irqsave(&o->lock, flags);
+	f = find_fetch(o, sector, count);
+	if (f)
+	{
+		o->joined++;
+		job->fetch = f;
+		kept = f->done;
+		if (kept)
+		{	// kept, write it right away
+			atomic_inc(&f->refs);
+			list_move_tail(&f->lru, &o->lru);
+		}
+		else
+		{
+			list_add_tail(&job->list, &f->jobs);
+		}
+		spin_unlock_irqrestore(&o->lock, flags);
+		if (n) fc_fetch_put(n);
+		if (kept) write_cache(job);
+		return 0;
+	}
+	if (n == NULL)
+	{
+		spin_unlock_irqrestore(&o->lock, flags);
+		n = alloc_fetch(o, sector, count);
+		if (n == NULL) return -ENOMEM;
+		goto again;
+	}
+	f = n;
+	o->reads++;
+	list_add(&f->hash, fetch_bucket(o, sector));
+	list_add_tail(&job->list, &f->jobs);
+	job->fetch = f;
+	spin_unlock_irqrestore(&o->lock, flags);
+
+	region.bdev = job->origin.bdev;
+	region.sector = sector;
+	region.count = count;
+	io_req.bi_rw = READ;
+	io_req.mem.type = DM_IO_PAGE_LIST;
+	io_req.mem.offset = 0;
+	io_req.mem.ptr.pl = f->pages;
+	io_req.notify.fn = fetch_read_callback;
+	io_req.notify.context = f;
+	io_req.client = o->io_client;
+	if (dm_io(&io_req, 1, &region, NULL))
+	{
+		fetch_read_callback(1, f);
+	}
+	return 0;
+}
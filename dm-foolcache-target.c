@@ -0,0 +1,1599 @@
+/*
+ * Copyright (C) 2001-2003 Sistina Software (UK) Limited.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/slab.h>
+#include <linux/device-mapper.h>
+#include <linux/dm-kcopyd.h>
+#include <linux/dm-io.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/fiemap.h>
+
+//#include <arch/x86/include/asm/atomic.h>
+#include "dm-foolcache.h"
+
+// DECLARE_DM_KCOPYD_THROTTLE_WITH_MODULE_PARM(fc_cor,
+// 		"A percentage of time allocated for Copy-On-Read");
+
+const static char SIGNATURE[]="FOOLCACHE";
+struct header {
+	char signature[sizeof(SIGNATURE)];
+	unsigned int block_size;
+	unsigned int trace_sectors;	// 0 without a trace region
+	unsigned int trace_entries;
+	u64 sectors;			// of the devices, 0 in older headers
+};
+
+static struct kmem_cache* fc_io_cache;
+
+static struct proc_dir_entry* fcdir_proc;
+static inline void proc_new_entry(struct foolcache_c* fcc);
+static inline void proc_remove_entry(struct foolcache_c* fcc);
+
+inline unsigned char cout_bits_uchar(unsigned char x)
+{
+	return (x&1) + ((x>>1)&1) + ((x>>2)&1) + ((x>>3)&1)
+		 + ((x>>4)&1) + ((x>>5)&1) + ((x>>6)&1) + ((x>>7));
+}
+
+static unsigned long count_bits(void* buf, unsigned long size)
+{
+	unsigned long i, r;
+	unsigned char table[256];
+	unsigned char* _buf = (unsigned char*)buf;
+	for (i=0; i<256; ++i)
+	{
+		table[i] = cout_bits_uchar(i);
+	}
+	for (i=r=0; i<size/sizeof(_buf[0]); ++i)
+	{
+		r+=table[_buf[i]];
+	}
+	for (i*=sizeof(_buf[0]); i<size; ++i)
+	{
+		r+=test_bit(i, buf);
+	}
+	return r;
+}
+
+// static unsigned long count_bits_offset(void* buf, 
+// 	unsigned long offset, unsigned long size)
+// {
+// 	unsigned long r;
+// 	unsigned char i=offset%8;
+// 	buf = (char*)buf + offset/8;
+// 	if (i==0) return count_bits(buf, size);
+
+// 	r = 0;
+// 	size -= (8-i);
+// 	for (; i<8; ++i)
+// 	{
+// 		r += test_bit(i, buf);
+// 	}
+// 	buf = (char*)buf +1;
+// 	return r + count_bits(buf, size);
+// }
+
+static int setup_layout(struct foolcache_c* fcc);
+
+// room for the access trace, in sectors
+static inline unsigned int fc_trace_sectors(struct foolcache_c* fcc)
+{
+	unsigned long n = min_t(unsigned long, fcc->blocks, FC_TRACE_MAX_BLOCKS);
+	return DIV_ROUND_UP(n * sizeof(u32), 512);
+}
+
+static int write_header(struct foolcache_c* fcc)
+{
+	int r;
+	struct dm_io_region region = {
+		.bdev = fcc->meta->bdev,
+		.sector = fcc->header_sector,
+		.count = 1,
+	};
+	struct dm_io_request io_req = {
+		.bi_rw = WRITE,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.vma = fcc->header,
+		// .notify.fn = ,
+		// .notify.context = ,
+		.client = fcc->io_client,
+	};
+
+	memcpy(fcc->header->signature, SIGNATURE, sizeof(SIGNATURE));
+	fcc->header->block_size = fcc->block_size;
+	fcc->header->trace_sectors = fcc->trace_sectors;
+	fcc->header->sectors = fcc->sectors;
+	r = dm_io(&io_req, 1, &region, NULL);
+	return r;
+}
+
+// write the access trace to its region, and its length to the header
+static int write_trace(struct foolcache_c* fcc)
+{
+	int r;
+	unsigned int n;
+	struct dm_io_region region;
+	struct dm_io_request io_req;
+
+	if (!fcc->trace_sectors || !fcc->trace || !fcc->trace_dirty)
+	{
+		return 0;
+	}
+
+	n = min_t(unsigned int, atomic_read(&fcc->trace_len), fcc->trace_cap);
+	if (n)
+	{
+		region.bdev = fcc->meta->bdev;
+		region.sector = fcc->trace_sector;
+		region.count = DIV_ROUND_UP(n * sizeof(u32), 512);
+		io_req.bi_rw = WRITE;
+		io_req.mem.type = DM_IO_VMA;
+		io_req.mem.ptr.vma = fcc->trace;
+		io_req.notify.fn = NULL;
+		io_req.client = fcc->io_client;
+		this_cpu_inc(fcc->stats->meta_writes);
+		this_cpu_add(fcc->stats->meta_bytes, region.count * 512);
+		r = dm_io(&io_req, 1, &region, NULL);
+		if (r!=0) return r;
+	}
+	if (!fcc->recording) fcc->trace_dirty = 0;
+	fcc->header->trace_entries = n;
+	return write_header(fcc);
+}
+
+static inline int write_ender(struct foolcache_c* fcc)
+{
+	return write_bitmap(fcc, NULL) || write_trace(fcc) || write_header(fcc);
+}
+
+static int read_ender(struct foolcache_c* fcc)
+{
+	int r;
+	struct dm_io_region region = {
+		.bdev = fcc->meta->bdev,
+		.sector = fcc->header_sector,
+		.count = 1,
+	};
+	struct dm_io_request io_req = {
+		.bi_rw = READ,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.vma = fcc->header,
+		// .notify.fn = ,
+		// .notify.context = ,
+		.client = fcc->io_client,
+	};
+	r=dm_io(&io_req, 1, &region, NULL);
+	if (r!=0) return r;
+
+	r=strncmp(fcc->header->signature, SIGNATURE, sizeof(SIGNATURE)-1);
+	if (r!=0) return r;
+	if (fcc->header->block_size != fcc->block_size) return -EINVAL;
+	if (fcc->header->sectors && fcc->header->sectors != fcc->sectors)
+		return -EINVAL;	// resized while not loaded
+	if (fcc->header->trace_sectors)
+	{	// the trace region takes room from the data, or the metadata device
+		if (fcc->header->trace_sectors != fc_trace_sectors(fcc) ||
+			fcc->header->trace_entries > 
+				fcc->header->trace_sectors * (512/sizeof(u32)))
+			return -EINVAL;
+		fcc->trace_sectors = fcc->header->trace_sectors;
+		r = setup_layout(fcc);
+		if (r!=0) return r;
+	}
+
+	io_req.mem.ptr.addr = fcc->bitmap;
+	region.sector = fcc->bitmap_sector;
+	region.count = fcc->bitmap_sectors;
+	r = dm_io(&io_req, 1, &region, NULL);
+	if (r==0) fcc->bitmap_modified = 0;
+	return r;
+}
+
+static int alloc_trace(struct foolcache_c* fcc)
+{
+	fcc->trace_cap = fc_trace_sectors(fcc) * (512/sizeof(u32));
+	fcc->trace = vzalloc(fc_trace_sectors(fcc) * 512);
+	return fcc->trace ? 0 : -ENOMEM;
+}
+
+static int read_trace(struct foolcache_c* fcc)
+{
+	int r;
+	unsigned int n = fcc->header->trace_entries;
+	struct dm_io_region region = {
+		.bdev = fcc->meta->bdev,
+		.sector = fcc->trace_sector,
+		.count = DIV_ROUND_UP(n * sizeof(u32), 512),
+	};
+	struct dm_io_request io_req = {
+		.bi_rw = READ,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.vma = fcc->trace,
+		.client = fcc->io_client,
+	};
+	if (n == 0) return 0;
+	r = dm_io(&io_req, 1, &region, NULL);
+	if (r==0) atomic_set(&fcc->trace_len, n);
+	return r;
+}
+
+// start logging first accesses over, into an empty trace
+static int start_recording(struct foolcache_c* fcc)
+{
+	if (fcc->blocks - 1 > (u32)~0U) return -EINVAL;
+	if (fcc->trace == NULL && alloc_trace(fcc)) return -ENOMEM;
+	if (fcc->accessed == NULL)
+	{
+		fcc->accessed = vzalloc(fcc->bitmap_sectors * 512);
+		if (fcc->accessed == NULL) return -ENOMEM;
+	}
+
+	fcc->recording = 0;
+	smp_mb();
+	memset(fcc->accessed, 0, fcc->bitmap_sectors * 512);
+	atomic_set(&fcc->trace_len, 0);
+	fcc->trace_dirty = 1;
+	smp_wmb();
+	fcc->recording = 1;
+	return 0;
+}
+
+static int stop_recording(struct foolcache_c* fcc)
+{
+	fcc->recording = 0;
+	smp_mb();
+	return write_trace(fcc);
+}
+
+/*
+ * The header, the bitmap and the optional access trace live either on a
+ * dedicated metadata device, leaving all of origin cacheable:
+ *
+ *      | header | bitmap | trace |
+ *
+ * or at the tail of the cache device:
+ *
+ *      | data ... | trace | bitmap | header |
+ *
+ * in which case blocks overlapping the metadata are never cached. The header
+ * and the bitmap don't move with the trace region.
+ */
+static int setup_layout(struct foolcache_c* fcc)
+{
+	unsigned int meta = 1 + fcc->bitmap_sectors + fcc->trace_sectors;
+	if (fcc->meta != fcc->cache)
+	{
+		sector_t meta_sectors = i_size_read(fcc->meta->bdev->bd_inode) >> SECTOR_SHIFT;
+		if (meta_sectors < meta) return -ENOSPC;
+		fcc->header_sector = 0;
+		fcc->bitmap_sector = 1;
+		fcc->trace_sector = fcc->bitmap_sector + fcc->bitmap_sectors;
+		fcc->last_caching_sector = fcc->sectors - 1;
+		return 0;
+	}
+
+	if (fcc->sectors < meta + fcc->block_size) return -ENOSPC;
+	fcc->header_sector = fcc->sectors - 1;
+	fcc->bitmap_sector = fcc->header_sector - fcc->bitmap_sectors;
+	fcc->trace_sector = fcc->bitmap_sector - fcc->trace_sectors;
+	fcc->last_caching_sector = block2sector(fcc, 
+		sector2block(fcc, fcc->trace_sector)) - 1;
+	return 0;
+}
+
+/*
+ * Targets resumed, by cache device. A table reloaded over one of them, on
+ * devices grown maybe, takes its cache over when resumed: the bitmap comes
+ * from memory and the metadata is written where the new size puts it.
+ */
+static DEFINE_MUTEX(fc_live_lock);
+static LIST_HEAD(fc_live_targets);
+
+// lock held
+static struct foolcache_c* find_live_target(struct foolcache_c* fcc)
+{
+	struct foolcache_c* f;
+	list_for_each_entry(f, &fc_live_targets, live_list)
+	{
+		if (f->cache->bdev->bd_dev == fcc->cache->bdev->bd_dev) return f;
+	}
+	return NULL;
+}
+
+// lock held
+static int take_over(struct foolcache_c* fcc, struct foolcache_c* old)
+{
+	unsigned int n;
+	if (!old->suspended) return -EBUSY;	// live on another device
+	if (old->block_size != fcc->block_size || old->sectors > fcc->sectors)
+		return -EINVAL;
+	wait_bitmap(old);	// or it may land over the new tail metadata
+
+	memcpy(fcc->bitmap, old->bitmap, old->bitmap_sectors * 512);
+	if (old->sectors & (old->block_size - 1))
+	{	// the old last block was copied short
+		clear_bit(old->blocks - 1, fcc->bitmap);
+	}
+	if (last_caching_block(fcc) + 1 < fcc->blocks)
+	{	// under the new tail metadata, which may start below the old one
+		bitmap_clear(fcc->bitmap, last_caching_block(fcc) + 1,
+			fcc->blocks - last_caching_block(fcc) - 1);
+	}
+	atomic64_set(&fcc->cached_blocks,
+		count_bits(fcc->bitmap, fcc->bitmap_sectors * 512));
+	fcc->bitmap_modified = 1;
+	if (fcc->trace && old->trace && !fcc->recording)
+	{
+		n = min_t(unsigned int, atomic_read(&old->trace_len),
+			min(old->trace_cap, fcc->trace_cap));
+		memcpy(fcc->trace, old->trace, n * sizeof(u32));
+		atomic_set(&fcc->trace_len, n);
+		fcc->trace_dirty = 1;
+	}
+
+	// old writes no more, its tail metadata now lies in uncached blocks
+	old->retired = 1;
+	list_del_init(&old->live_list);
+	return write_ender(fcc);
+}
+
+static inline bool isorder2(unsigned int x)
+{
+	return (x & (x-1)) == 0;
+}
+
+static inline unsigned long DIV(unsigned long a, unsigned long b)
+{
+	return a/b + (a%b > 0);
+}
+
+/*
+ * Construct a foolcache mapping
+ *      origin cache block_size [create] [metadev <dev>] [record] [prewarm]
+ *      [subblock <KB>] [shared]
+ * Reloaded over a live target on the same cache, grown maybe, the cache is
+ * taken over on resume instead of read.
+ */
+static int foolcache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
+{
+	struct foolcache_c *fcc, *live;
+	unsigned int bs, sbs = 0, bitmap_size, r, i;
+	bool create = false, record = false, prewarm = false, shared = false;
+	char* metadev = NULL;
+
+	if (argc<3) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+
+	for (i=3; i<argc; ++i) {
+		if (strcmp(argv[i], "create")==0) {
+			create = true;
+		} else if (strcmp(argv[i], "metadev")==0 && i+1<argc) {
+			metadev = argv[++i];
+		} else if (strcmp(argv[i], "record")==0) {
+			record = true;
+		} else if (strcmp(argv[i], "prewarm")==0) {
+			prewarm = true;
+		} else if (strcmp(argv[i], "shared")==0) {
+			shared = true;
+		} else if (strcmp(argv[i], "subblock")==0 && i+1<argc) {
+			if (sscanf(argv[++i], "%u", &sbs)!=1 || sbs<4 || !isorder2(sbs)) {
+				ti->error = "Invalid sub-block size";
+				return -EINVAL;
+			}
+		} else {
+			ti->error = "Invalid argument";
+			return -EINVAL;
+		}
+	}
+
+	fcc = vzalloc(sizeof(*fcc));
+	if (fcc == NULL) {
+		ti->error = "dm-foolcache: Cannot allocate foolcache context";
+		return -ENOMEM;
+	}
+
+	if (dm_get_device(ti, argv[0], FMODE_READ, &fcc->origin)) {
+		ti->error = "dm-foolcache: Device lookup failed";
+		goto bad1;
+	}
+
+	if (dm_get_device(ti, argv[1], FMODE_READ|FMODE_WRITE, &fcc->cache)) {
+		ti->error = "dm-foolcache: Device lookup failed";
+		goto bad2;
+	}
+
+	fcc->meta = fcc->cache;
+	if (metadev && dm_get_device(ti, metadev, FMODE_READ|FMODE_WRITE, &fcc->meta)) {
+		ti->error = "dm-foolcache: Metadata device lookup failed";
+		fcc->meta = NULL;
+		goto bad3;
+	}
+	if (metadev && (fcc->meta->bdev == fcc->cache->bdev ||
+		fcc->meta->bdev == fcc->origin->bdev))
+	{	// the bitmap would land on data; the table holds it once more
+		ti->error = "dm-foolcache: Metadata device is the cache or the origin";
+		dm_put_device(ti, fcc->meta);
+		fcc->meta = NULL;
+		goto bad3;
+	}
+
+	fcc->size = i_size_read(fcc->origin->bdev->bd_inode);
+	fcc->sectors = (fcc->size >> SECTOR_SHIFT);
+	if (fcc->size != i_size_read(fcc->cache->bdev->bd_inode))
+	{
+		ti->error = "dm-foolcache: Device sub-device size mismatch";
+		goto bad3;
+	}
+
+	if (sscanf(argv[2], "%u", &bs)!=1 || bs<4 || bs>1024*1024 || !isorder2(bs)) {
+		ti->error = "dm-foolcache: Invalid block size";
+		goto bad3;
+	}
+	printk("dm-foolcache: bs %uKB\n", bs);
+
+	bs*=(1024/512); // KB to sector
+	fcc->blocks = DIV(fcc->sectors, bs);
+	fcc->block_size = bs;
+	fcc->block_shift = ffs(bs)-1;
+	fcc->block_mask = ~(bs-1);
+	printk("dm-foolcache: bshift %u, bmask %u\n", fcc->block_shift, fcc->block_mask);
+	if (sbs)
+	{	// copy misses by sub-block
+		sbs*=(1024/512);
+		if (sbs >= bs) {
+			ti->error = "dm-foolcache: Sub-block size not below block size";
+			goto bad3;
+		}
+		fcc->subblock_shift = ffs(sbs)-1;
+		fcc->subblocks = bs/sbs;
+	}
+	fcc->bitmap_sectors = DIV(fcc->blocks, 8*512); 	// sizeof bitmap, in sector
+	if (create && record)
+	{	// reserve a region to keep the trace in
+		fcc->trace_sectors = fc_trace_sectors(fcc);
+	}
+	INIT_LIST_HEAD(&fcc->live_list);
+	mutex_lock(&fc_live_lock);
+	live = create ? NULL : find_live_target(fcc);
+	if (live && (live->block_size != fcc->block_size || live->sectors > fcc->sectors)) {
+		mutex_unlock(&fc_live_lock);
+		ti->error = "dm-foolcache: Reload changes the block size, or shrinks";
+		goto bad3;
+	}
+	if (live) {	// a reload, keeping the trace region of the live target
+		fcc->takeover = true;
+		if (live->trace_sectors) fcc->trace_sectors = fc_trace_sectors(fcc);
+	}
+	mutex_unlock(&fc_live_lock);
+	if (setup_layout(fcc))
+	{
+		ti->error = "dm-foolcache: No room for metadata";
+		goto bad3;
+	}
+	bitmap_size = fcc->bitmap_sectors*512;
+	fcc->bitmap = vzalloc(bitmap_size);
+	fcc->copying = vzalloc(bitmap_size);
+	fcc->header = vzalloc(512);
+	fcc->region_gen = vzalloc(DIV(fcc->blocks, FOOLCACHE_REGION_BLOCKS) * sizeof(u64));
+	if (fcc->bitmap==NULL || fcc->copying==NULL || fcc->header==NULL || 
+		fcc->region_gen==NULL)
+	{
+		ti->error = "dm-foolcache: Cannot allocate bitmaps";
+		goto bad4;
+	}
+
+	fcc->io_client = dm_io_client_create();
+	if (IS_ERR(fcc->io_client)) 
+	{
+		ti->error = "dm-foolcache: dm_io_client_create() error";
+		goto bad4;
+	}
+
+	fcc->kcopyd_client = dm_kcopyd_client_create();
+	// fcc->kcopyd_client = dm_kcopyd_client_create(&dm_kcopyd_throttle);
+	if (IS_ERR(fcc->kcopyd_client))
+	{
+		ti->error = "dm-foolcache: dm_kcopyd_client_create() error";
+		goto bad5;
+	}
+
+	fcc->stats = alloc_percpu(struct fc_stats);
+	fcc->io_pool = mempool_create_slab_pool(16, fc_io_cache);
+	if (fcc->stats == NULL || fcc->io_pool == NULL)
+	{
+		ti->error = "dm-foolcache: Cannot allocate statistics";
+		goto bad6;
+	}
+
+	if (fc_core_init(fcc))
+	{
+		ti->error = "dm-foolcache: Cannot allocate the completion workqueue";
+		goto bad6;
+	}
+	if (shared && (fcc->shared = fc_shared_get(fcc->origin->bdev)) == NULL)
+	{
+		ti->error = "dm-foolcache: Cannot share the origin";
+		goto bad7;
+	}
+	memset(fcc->copying, 0, bitmap_size);
+	if (create)
+	{	// create new cache
+		atomic64_set(&fcc->cached_blocks, 0);
+		memset(fcc->bitmap, 0, bitmap_size);
+		fcc->bitmap_modified = 1;
+		r = write_ender(fcc);
+		if (r!=0)
+		{
+			ti->error = "dm-foolcache: ender write error";
+			goto bad7;
+		}
+	}
+	else if (fcc->takeover)
+	{	// the live target hands its cache over on resume
+		atomic64_set(&fcc->cached_blocks, 0);
+	}
+	else
+	{	// open existing cache
+		r = read_ender(fcc);
+		atomic64_set(&fcc->cached_blocks, 
+			count_bits(fcc->bitmap, bitmap_size));
+		if (r!=0)
+		{
+			ti->error = "dm-foolcache: ender read error";
+			goto bad7;
+		}
+	}
+
+	if (fcc->trace_sectors && (alloc_trace(fcc) || read_trace(fcc)))
+	{
+		ti->error = "dm-foolcache: Cannot read the access trace";
+		goto bad7;
+	}
+	if (prewarm && atomic_read(&fcc->trace_len))
+	{	// replayed on activation, the trace may be recorded over meanwhile
+		fcc->prewarm_count = atomic_read(&fcc->trace_len);
+		fcc->prewarm_log = vmalloc(fcc->prewarm_count * sizeof(u32));
+		if (fcc->prewarm_log == NULL)
+		{
+			ti->error = "dm-foolcache: Cannot allocate the prewarm log";
+			goto bad7;
+		}
+		memcpy(fcc->prewarm_log, fcc->trace, fcc->prewarm_count * sizeof(u32));
+	}
+	if (record && start_recording(fcc))
+	{
+		ti->error = "dm-foolcache: Cannot record the access trace";
+		goto bad7;
+	}
+	fcc->record = record;
+	fcc->prewarm = prewarm;
+	fcc->bitmap_last_sync = jiffies;
+	proc_new_entry(fcc);
+
+	ti->num_flush_requests = 1;
+	ti->num_discard_requests = 1;
+	ti->private = fcc;
+	printk("dm-foolcache: ctor succeeed\n");
+	return 0;
+
+bad7:
+	fc_core_exit(fcc);
+	if (fcc->shared) fc_shared_put(fcc->shared);
+bad6:
+	if (fcc->io_pool) mempool_destroy(fcc->io_pool);
+	if (fcc->stats) free_percpu(fcc->stats);
+	dm_kcopyd_client_destroy(fcc->kcopyd_client);
+bad5:
+	dm_io_client_destroy(fcc->io_client);
+bad4:
+	if (fcc->bitmap) vfree(fcc->bitmap);
+	if (fcc->copying) vfree(fcc->copying);
+	if (fcc->header) vfree(fcc->header);
+	if (fcc->region_gen) vfree(fcc->region_gen);
+	if (fcc->trace) vfree(fcc->trace);
+	if (fcc->accessed) vfree(fcc->accessed);
+	if (fcc->prewarm_log) vfree(fcc->prewarm_log);
+bad3:
+	if (fcc->meta && fcc->meta != fcc->cache) dm_put_device(ti, fcc->meta);
+	dm_put_device(ti, fcc->cache);
+bad2:
+	dm_put_device(ti, fcc->origin);
+bad1:
+	vfree(fcc);
+	printk("dm-foolcache: ctor failed\n");
+	return -EINVAL;
+}
+
+static void foolcache_dtr(struct dm_target *ti)
+{
+	struct foolcache_c *fcc = ti->private;
+	mutex_lock(&fc_live_lock);
+	list_del_init(&fcc->live_list);
+	mutex_unlock(&fc_live_lock);
+	wait_bitmap(fcc);
+	fc_core_exit(fcc);
+	if (!fcc->retired)
+	{
+		write_bitmap(fcc, NULL);
+		write_trace(fcc);
+	}
+	vfree(fcc->bitmap);
+	vfree(fcc->copying);
+	vfree(fcc->header);
+	vfree(fcc->region_gen);
+	if (fcc->trace) vfree(fcc->trace);
+	if (fcc->accessed) vfree(fcc->accessed);
+	if (fcc->prewarm_log) vfree(fcc->prewarm_log);
+	proc_remove_entry(fcc);
+	if (fcc->shared) fc_shared_put(fcc->shared);
+	dm_kcopyd_client_destroy(fcc->kcopyd_client);
+	dm_io_client_destroy(fcc->io_client);
+	mempool_destroy(fcc->io_pool);
+	free_percpu(fcc->stats);
+	if (fcc->meta != fcc->cache) dm_put_device(ti, fcc->meta);
+	dm_put_device(ti, fcc->origin);
+	dm_put_device(ti, fcc->cache);
+	vfree(fcc);
+}
+
+static int parse_block_range(struct foolcache_c* fcc, char** argv, 
+	unsigned long* start, unsigned long* end)
+{
+	if (sscanf(argv[0], "%lu", start)!=1 || sscanf(argv[1], "%lu", end)!=1)
+		return -EINVAL;
+	if (*start > *end || *end > last_caching_block(fcc))
+		return -EINVAL;
+	return 0;
+}
+
+static int parse_io_class(const char* name)
+{
+	if (strcmp(name, "miss")==0) return FC_IO_MISS;
+	if (strcmp(name, "readahead")==0) return FC_IO_READAHEAD;
+	if (strcmp(name, "hydrate")==0) return FC_IO_HYDRATE;
+	return -EINVAL;
+}
+
+// the limits of a class, its tokens start over
+static void set_class(struct foolcache_c* fcc, int cls, unsigned int max_inflight,
+	unsigned int weight, unsigned int iops, unsigned int bandwidth)
+{
+	unsigned long flags;
+	struct fc_class* c = &fcc->sched.classes[cls];
+
+	spin_lock_irqsave(&fcc->sched.lock, flags);
+	c->max_inflight = max_inflight;
+	c->weight = weight;
+	c->iops = iops;
+	c->bandwidth = bandwidth;
+	c->iops_tokens = c->bw_tokens = 0;
+	spin_unlock_irqrestore(&fcc->sched.lock, flags);
+	fc_sched_dispatch(fcc);
+}
+
+static int set_class_limits(struct foolcache_c* fcc, char** argv)
+{
+	int cls = parse_io_class(argv[0]);
+	unsigned int max_inflight, weight, iops, bandwidth;
+
+	if (cls < 0 || sscanf(argv[1], "%u", &max_inflight)!=1 || 
+		sscanf(argv[2], "%u", &weight)!=1 || weight==0 || 
+		sscanf(argv[3], "%u", &iops)!=1 || sscanf(argv[4], "%u", &bandwidth)!=1)
+		return -EINVAL;
+
+	set_class(fcc, cls, max_inflight, weight, iops, bandwidth);
+	return 0;
+}
+
+/*
+ * Messages:
+ *      copy_jobs <n>			copies in flight on the origin
+ *      flush_interval <seconds>	bitmap sync interval, 0 to disable
+ *      wait_timeout <ms>		re-check interval of waits on copies
+ *      readahead <blocks>		blocks copied after a miss, 0 to disable
+ *      hydrate_rate <KB/s>		bandwidth cap of hydration, 0 for none
+ *      policy strict|weighted		how the scheduler picks a class
+ *      class <class> <max inflight> <weight> <iops> <KB/s>
+ *      sync				write the bitmap and the trace now
+ *      error_threshold <n>		errors in a window to bypass, 0 never
+ *      error_window <seconds>		window of error_threshold
+ *      bypass_recover <seconds>	leave bypass mode after, 0 never
+ *      clear_bypass			leave bypass mode
+ *      hydrate <start> <end>		copy blocks in the background
+ *      invalidate <start> <end>	drop blocks from the cache
+ *      record start|stop		(re)start or stop the access trace
+ */
+static int foolcache_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	int r;
+	unsigned int x;
+	unsigned long start, end;
+	struct foolcache_c *fcc = ti->private;
+
+	if (argc==1 && strcmp(argv[0], "sync")==0)
+	{
+		fcc->bitmap_last_sync = jiffies;
+		r = write_bitmap(fcc, NULL);
+		return r ? r : write_trace(fcc);
+	}
+
+	if (argc==2 && strcmp(argv[0], "record")==0)
+	{
+		if (strcmp(argv[1], "start")==0)
+			return start_recording(fcc);
+		if (strcmp(argv[1], "stop")==0)
+			return stop_recording(fcc);
+		return -EINVAL;
+	}
+
+	if (argc==1 && strcmp(argv[0], "clear_bypass")==0)
+	{
+		leave_bypass(fcc);
+		return 0;
+	}
+
+	if (argc==3 && strcmp(argv[0], "hydrate")==0)
+	{
+		if (parse_block_range(fcc, argv+1, &start, &end))
+			return -EINVAL;
+		return hydrate_blocks(fcc, start, end, FC_IO_HYDRATE);
+	}
+
+	if (argc==3 && strcmp(argv[0], "invalidate")==0)
+	{
+		if (parse_block_range(fcc, argv+1, &start, &end))
+			return -EINVAL;
+		return invalidate_blocks(fcc, start, end);
+	}
+
+	if (argc==6 && strcmp(argv[0], "class")==0)
+	{
+		return set_class_limits(fcc, argv+1);
+	}
+
+	if (argc==2 && strcmp(argv[0], "policy")==0)
+	{
+		if (strcmp(argv[1], "strict")==0)
+			fcc->sched.policy = FC_SCHED_STRICT;
+		else if (strcmp(argv[1], "weighted")==0)
+			fcc->sched.policy = FC_SCHED_WEIGHTED;
+		else
+			return -EINVAL;
+		return 0;
+	}
+
+	if (argc!=2 || sscanf(argv[1], "%u", &x)!=1)
+	{
+		DMWARN("unrecognised message received.");
+		return -EINVAL;
+	}
+
+	if (strcmp(argv[0], "copy_jobs")==0 && x>0)
+	{
+		fcc->sched.max_inflight = x;
+		fc_sched_dispatch(fcc);
+	}
+	else if (strcmp(argv[0], "flush_interval")==0)
+	{
+		fcc->flush_interval = x*HZ;
+	}
+	else if (strcmp(argv[0], "wait_timeout")==0 && x>0)
+	{
+		fcc->wait_timeout = msecs_to_jiffies(x);
+	}
+	else if (strcmp(argv[0], "error_threshold")==0)
+	{
+		fcc->error_threshold = x;
+	}
+	else if (strcmp(argv[0], "error_window")==0 && x>0)
+	{
+		fcc->error_window = x*HZ;
+	}
+	else if (strcmp(argv[0], "bypass_recover")==0)
+	{
+		fcc->bypass_recover = x*HZ;
+		fcc->bypass_until = jiffies + fcc->bypass_recover;
+	}
+	else if (strcmp(argv[0], "readahead")==0)
+	{
+		fcc->readahead = x;
+	}
+	else if (strcmp(argv[0], "hydrate_rate")==0)
+	{
+		struct fc_class* c = &fcc->sched.classes[FC_IO_HYDRATE];
+		set_class(fcc, FC_IO_HYDRATE, c->max_inflight, c->weight, c->iops, x);
+	}
+	else
+	{
+		DMWARN("unrecognised message received.");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void foolcache_postsuspend(struct dm_target *ti)
+{
+	struct foolcache_c *fcc = ti->private;
+	fc_sched_quiesce(fcc);
+}
+
+static int foolcache_preresume(struct dm_target *ti)
+{
+	int r = 0;
+	struct foolcache_c *fcc = ti->private, *live;
+
+	mutex_lock(&fc_live_lock);
+	if (fcc->takeover)
+	{
+		live = find_live_target(fcc);
+		r = live ? take_over(fcc, live) : -ENODEV;
+		if (r!=0)
+		{
+			mutex_unlock(&fc_live_lock);
+			DMWARN("cannot take the live cache over: %d", r);
+			return r;
+		}
+		fcc->takeover = false;
+	}
+	if (list_empty(&fcc->live_list))
+	{
+		list_add(&fcc->live_list, &fc_live_targets);
+	}
+	mutex_unlock(&fc_live_lock);
+	return 0;
+}
+
+static void foolcache_resume(struct dm_target *ti)
+{
+	struct foolcache_c *fcc = ti->private;
+	fc_sched_resume(fcc);
+	if (fcc->prewarm_log)
+	{	// replay the trace ahead of the first reads
+		prewarm_blocks(fcc, fcc->prewarm_log, fcc->prewarm_count);
+		fcc->prewarm_log = NULL;
+	}
+}
+
+static const char* fc_path_names[FC_PATHS] = 
+	{"hit", "miss", "wait", "bypass", "flush"};
+
+/*
+ * <cached blocks> <blocks> <hits> <misses> <bypassing> <bytes copied> 
+ * <copies in flight> <queued miss>,<queued readahead>,<queued hydrate> 
+ * <metadata writes> <metadata bytes> 
+ * <copy errors> <cache read errors> <blocks in backoff> <partial blocks>
+ * followed, for each path, by <path>:<count>:<total us>:<b0>,<b1>,...
+ * with trailing empty buckets omitted
+ */
+static void foolcache_status_info(struct foolcache_c *fcc, 
+		char *result, unsigned int maxlen)
+{
+	int i, j, last;
+	unsigned int sz = 0;
+	u64 hist[FC_HIST_BUCKETS], count, total;
+	struct fc_sched* s = &fcc->sched;
+
+	DMEMIT("%llu %lu %llu %llu %u %llu %u %u,%u,%u %llu %llu %llu %llu %u %u",
+		(unsigned long long)atomic64_read(&fcc->cached_blocks), fcc->blocks, 
+		(unsigned long long)atomic64_read(&fcc->hits), 
+		(unsigned long long)atomic64_read(&fcc->misses), fcc->bypassing, 
+		(unsigned long long)fc_stats_sum(fcc, bytes_copied), s->inflight,
+		s->classes[FC_IO_MISS].queued, s->classes[FC_IO_READAHEAD].queued,
+		s->classes[FC_IO_HYDRATE].queued,
+		(unsigned long long)fc_stats_sum(fcc, meta_writes), 
+		(unsigned long long)fc_stats_sum(fcc, meta_bytes),
+		(unsigned long long)atomic64_read(&fcc->copy_errors),
+		(unsigned long long)atomic64_read(&fcc->read_errors),
+		fcc->error_blocks, fcc->partial_blocks);
+
+	for (i=0; i<FC_PATHS; ++i)
+	{
+		total = fc_stats_hist(fcc, i, hist);
+		for (j=count=0, last=-1; j<FC_HIST_BUCKETS; ++j)
+		{
+			count += hist[j];
+			if (hist[j]) last = j;
+		}
+		DMEMIT(" %s:%llu:%llu:", fc_path_names[i], 
+			(unsigned long long)count, (unsigned long long)total);
+		for (j=0; j<=last; ++j)
+		{
+			DMEMIT(j ? ",%llu" : "%llu", (unsigned long long)hist[j]);
+		}
+	}
+}
+
+static void foolcache_status(struct dm_target *ti, status_type_t type,
+		char *result, unsigned int maxlen)
+{
+	struct foolcache_c *fcc = ti->private;
+	unsigned int sz = 0;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		foolcache_status_info(fcc, result, maxlen);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s %s %u", fcc->origin->name, 
+			fcc->cache->name, fcc->block_size*512/1024);
+		if (fcc->meta != fcc->cache)
+		{
+			DMEMIT(" metadev %s", fcc->meta->name);
+		}
+		if (fcc->record)
+		{
+			DMEMIT(" record");
+		}
+		if (fcc->prewarm)
+		{
+			DMEMIT(" prewarm");
+		}
+		if (fcc->subblock_shift)
+		{
+			DMEMIT(" subblock %u", (1 << fcc->subblock_shift)*512/1024);
+		}
+		if (fcc->shared)
+		{
+			DMEMIT(" shared");
+		}
+		break;
+	}
+}
+
+static inline int foolcache_fibmap(struct foolcache_c *fcc, int __user *p)
+{
+	int res, block;
+	res = get_user(block, p);
+	if (res) return res;
+	if (block >= fcc->blocks) return -1;
+	block = test_bit(block, fcc->bitmap)!=0;
+	return put_user(block, p);
+}
+
+static inline int foolcache_figetbsz(struct foolcache_c *fcc, int __user *p)
+{
+	return put_user(fcc->block_size*512, p);
+}
+
+static int get_range(struct foolcache_c *fcc, void __user *p, 
+	struct foolcache_range* range)
+{
+	unsigned long last = last_caching_block(fcc);
+	if (copy_from_user(range, p, sizeof(*range)))
+		return -EFAULT;
+	if (range->count == 0 || range->count > FOOLCACHE_CLAIM_MAX || 
+		range->start > last)
+		return -EINVAL;
+	range->count = min_t(u64, range->count, last - range->start + 1);
+	return 0;
+}
+
+static int foolcache_claim(struct foolcache_c *fcc, void __user *p)
+{
+	int r;
+	unsigned long i, block, flags;
+	struct foolcache_range range;
+	struct fc_claim *claim, *c;
+	unsigned char* out;
+
+	r = get_range(fcc, p, &range);
+	if (r) return r;
+	if (fcc->suspended) return -EAGAIN;
+
+	expire_claims(fcc, false);
+	claim = kzalloc(sizeof(*claim) + 
+		BITS_TO_LONGS(range.count) * sizeof(long), GFP_KERNEL);
+	out = kzalloc(DIV_ROUND_UP(range.count, 8), GFP_KERNEL);
+	if (claim == NULL || out == NULL)
+	{
+		kfree(claim);
+		kfree(out);
+		return -ENOMEM;
+	}
+	claim->start = range.start;
+	claim->count = range.count;
+
+	spin_lock_irqsave(&fcc->claim_lock, flags);
+	list_for_each_entry(c, &fcc->claims, list)
+	{
+		if (c->start == claim->start) r = -EBUSY;
+	}
+	if (fcc->nr_claims >= FC_MAX_CLAIMS) r = -EBUSY;
+	if (r)
+	{
+		spin_unlock_irqrestore(&fcc->claim_lock, flags);
+		kfree(claim);
+		kfree(out);
+		return r;
+	}
+
+	for (i=range.claimed=0; i<range.count; ++i)
+	{
+		block = range.start + i;
+		if (test_bit(block, fcc->bitmap) || test_and_set_bit(block, fcc->copying))
+			continue;
+		if (test_bit(block, fcc->bitmap))
+		{
+			end_copying(fcc, block);
+			continue;
+		}
+		set_bit(i, claim->bits);
+		__set_bit_le(i, out);
+		range.claimed++;
+	}
+	if (range.claimed)
+	{	// not ready, neither published nor expired until handed out
+		list_add_tail(&claim->list, &fcc->claims);
+		fcc->nr_claims++;
+	}
+	spin_unlock_irqrestore(&fcc->claim_lock, flags);
+
+	if (copy_to_user((void __user *)(unsigned long)range.bitmap, 
+			out, DIV_ROUND_UP(range.count, 8)) ||
+		copy_to_user(p, &range, sizeof(range)))
+		r = -EFAULT;
+	kfree(out);
+	if (range.claimed == 0)
+	{
+		kfree(claim);
+		return r;
+	}
+
+	spin_lock_irqsave(&fcc->claim_lock, flags);
+	if (r==0)
+	{
+		claim->expires = jiffies + FC_CLAIM_LEASE;
+		claim->ready = true;
+	}
+	else
+	{
+		list_del(&claim->list);
+		fcc->nr_claims--;
+	}
+	spin_unlock_irqrestore(&fcc->claim_lock, flags);
+	if (r)
+	{	// nobody knows of it, release the blocks
+		for_each_set_bit(i, claim->bits, claim->count)
+		{
+			end_copying(fcc, claim->start + i);
+		}
+		kfree(claim);
+	}
+	return r;
+}
+
+static int foolcache_publish(struct foolcache_c *fcc, void __user *p)
+{
+	int r;
+	unsigned long i, block, flags;
+	unsigned long* copied;
+	struct foolcache_range range;
+	struct fc_claim *claim = NULL, *c;
+
+	r = get_range(fcc, p, &range);
+	if (r) return r;
+	copied = kzalloc(BITS_TO_LONGS(range.count) * sizeof(long), GFP_KERNEL);
+	if (copied == NULL) return -ENOMEM;
+	if (copy_from_user(copied, (void __user *)(unsigned long)range.bitmap, 
+		DIV_ROUND_UP(range.count, 8)))
+	{
+		kfree(copied);
+		return -EFAULT;
+	}
+
+	spin_lock_irqsave(&fcc->claim_lock, flags);
+	list_for_each_entry(c, &fcc->claims, list)
+	{
+		if (c->ready && c->start == range.start && c->count == range.count)
+		{
+			claim = c;
+			list_del(&claim->list);
+			fcc->nr_claims--;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&fcc->claim_lock, flags);
+	if (claim == NULL)
+	{	// never claimed, or expired
+		kfree(copied);
+		return -ENOENT;
+	}
+
+	range.claimed = 0;
+	for_each_set_bit(i, claim->bits, claim->count)
+	{
+		block = claim->start + i;
+		if (test_bit_le(i, copied))
+		{
+			block_recovered(fcc, block);
+			set_bit(block, fcc->bitmap);
+			bitmap_changed(fcc, block);
+			atomic64_inc(&fcc->cached_blocks);
+			drop_partial(fcc, block);
+			range.claimed++;
+		}
+		end_copying(fcc, block);
+	}
+	kfree(claim);
+	kfree(copied);
+	if (copy_to_user(p, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
+
+static int foolcache_getbitmap(struct foolcache_c *fcc, void __user *p)
+{
+	int r = 0;
+	struct foolcache_bitmap q;
+	unsigned long block, end, next, i;
+	unsigned char __user *buf;
+	unsigned char* out;
+
+	if (copy_from_user(&q, p, sizeof(q)))
+		return -EFAULT;
+	if (q.start % 8 || q.start >= fcc->blocks)
+		return -EINVAL;
+	q.count = min_t(u64, q.count, fcc->blocks - q.start);
+	buf = (unsigned char __user *)(unsigned long)q.bitmap;
+	out = kmalloc(FOOLCACHE_REGION_BLOCKS / 8, GFP_KERNEL);
+	if (out == NULL) return -ENOMEM;
+
+	q.generation = atomic64_read(&fcc->generation);
+	smp_rmb();
+	if (q.since > q.generation)	// of another instance, the clock went back
+		q.since = 0;
+	q.changed = 0;
+	end = q.start + q.count;
+	for (block = q.start; block < end; block = next)
+	{
+		unsigned long region = block / FOOLCACHE_REGION_BLOCKS;
+		next = min_t(unsigned long, end, (region + 1) * FOOLCACHE_REGION_BLOCKS);
+		if (q.since && READ_ONCE(fcc->region_gen[region]) <= q.since)
+			continue;
+		// in the byte/bit layout of the ABI, whatever the endianness
+		memset(out, 0, DIV_ROUND_UP(next - block, 8));
+		for (i = find_next_bit(fcc->bitmap, next, block); i < next;
+			i = find_next_bit(fcc->bitmap, next, i + 1))
+		{
+			__set_bit_le(i - block, out);
+		}
+		if (copy_to_user(buf + (block - q.start) / 8, out, 
+				DIV_ROUND_UP(next - block, 8)))
+		{
+			r = -EFAULT;
+			break;
+		}
+		q.changed++;
+		cond_resched();
+	}
+	kfree(out);
+
+	if (r==0 && copy_to_user(p, &q, sizeof(q)))
+		r = -EFAULT;
+	return r;
+}
+
+static int foolcache_gettrace(struct foolcache_c *fcc, void __user *p)
+{
+	struct foolcache_trace q;
+	unsigned long n = 0;
+
+	if (copy_from_user(&q, p, sizeof(q)))
+		return -EFAULT;
+	if (fcc->trace)
+	{
+		n = min_t(unsigned long, atomic_read(&fcc->trace_len), fcc->trace_cap);
+	}
+	if (min_t(u64, q.count, n) && 
+		copy_to_user((void __user *)(unsigned long)q.blocks, fcc->trace, 
+			min_t(u64, q.count, n) * sizeof(u32)))
+		return -EFAULT;
+
+	q.count = n;
+	if (copy_to_user(p, &q, sizeof(q)))
+		return -EFAULT;
+	return 0;
+}
+
+static int foolcache_prewarm(struct foolcache_c *fcc, void __user *p)
+{
+	struct foolcache_trace q;
+	u32* blocks;
+
+	if (copy_from_user(&q, p, sizeof(q)))
+		return -EFAULT;
+	if (q.count == 0 || q.count > fcc->blocks)
+		return -EINVAL;
+	if (fcc->suspended) return -EAGAIN;
+
+	blocks = vmalloc(q.count * sizeof(u32));
+	if (blocks == NULL) return -ENOMEM;
+	if (copy_from_user(blocks, (void __user *)(unsigned long)q.blocks, 
+			q.count * sizeof(u32)))
+	{
+		vfree(blocks);
+		return -EFAULT;
+	}
+	return prewarm_blocks(fcc, blocks, q.count);
+}
+
+static int fiemap_check_ranges(struct foolcache_c *fcc,
+			       u64 start, u64 len, u64 *new_len)
+{
+	u64 maxbytes = (u64) fcc->size;
+
+	*new_len = len;
+
+	if (len == 0)
+		return -EINVAL;
+
+	if (start > maxbytes)
+		return -EFBIG;
+
+	/*
+	 * Shrink request scope to what the fs can actually handle.
+	 */
+	if (len > maxbytes || (maxbytes - len) < start)
+		*new_len = maxbytes - start;
+
+	return 0;
+}
+
+// static int ext4_fill_fiemap_extents(struct inode *inode,
+// 				    ext4_lblk_t block, ext4_lblk_t num,
+// 				    struct fiemap_extent_info *fieinfo)
+// {
+
+// }
+
+int fiemap_fill_next_extent(struct fiemap_extent_info *fieinfo, u64 logical,
+			    u64 phys, u64 len, u32 flags);
+
+
+int foolcache_do_fiemap(struct foolcache_c *fcc, struct fiemap_extent_info *fieinfo,
+	__u64 start, __u64 len)
+{
+	unsigned long i, c, shift;
+	shift = fcc->block_shift + 9;
+	for (i=c=0; i<fcc->blocks; ++i) 
+	{
+		if (test_bit(i, fcc->bitmap))
+		{
+			c++;
+			fiemap_fill_next_extent(fieinfo, i<<shift, i<<shift, 1<<shift, 
+				(c==atomic64_read(&fcc->cached_blocks)) ? FIEMAP_EXTENT_LAST : 0);
+		}
+	}
+	return 0;
+}
+
+#define FIEMAP_MAX_EXTENTS	(UINT_MAX / sizeof(struct fiemap_extent))
+static int foolcache_fiemap(struct foolcache_c *fcc, int __user *p)
+{
+	struct fiemap fiemap;
+	struct fiemap __user *ufiemap = (struct fiemap __user *) p;
+	struct fiemap_extent_info fieinfo = { 0, };
+	u64 len;
+	int error;
+
+	if (copy_from_user(&fiemap, ufiemap, sizeof(fiemap)))
+		return -EFAULT;
+
+	if (fiemap.fm_extent_count > FIEMAP_MAX_EXTENTS)
+		return -EINVAL;
+
+	error = fiemap_check_ranges(fcc, fiemap.fm_start, fiemap.fm_length,
+				    &len);
+	if (error)
+		return error;
+
+	fieinfo.fi_flags = fiemap.fm_flags;
+	fieinfo.fi_extents_max = fiemap.fm_extent_count;
+	fieinfo.fi_extents_start = ufiemap->fm_extents;
+
+	if (fiemap.fm_extent_count != 0 &&
+	    !access_ok(VERIFY_WRITE, fieinfo.fi_extents_start,
+		       fieinfo.fi_extents_max * sizeof(struct fiemap_extent)))
+		return -EFAULT;
+
+	error = foolcache_do_fiemap(fcc, &fieinfo, fiemap.fm_start, len);
+	fiemap.fm_flags = fieinfo.fi_flags;
+	fiemap.fm_mapped_extents = fieinfo.fi_extents_mapped;
+
+	if (copy_to_user(ufiemap, &fiemap, sizeof(fiemap)))
+		error = -EFAULT;
+
+	return error;
+}
+
+static int foolcache_ioctl(struct dm_target *ti, unsigned int cmd,
+			unsigned long arg)
+{
+	struct foolcache_c *fcc = ti->private;
+	int __user *p = (int __user *)arg;
+	//printk("dm-foolcache: ioctl cmd=0x%x\n", cmd);
+
+	switch (cmd)
+	{
+	case FOOLCACHE_GETBSZ:
+		return foolcache_figetbsz(fcc, p);
+
+	case FOOLCACHE_FIBMAP:
+		return foolcache_fibmap(fcc, p);
+
+	case FOOLCACHE_FIEMAP:
+		return foolcache_fiemap(fcc, p);
+
+	case FOOLCACHE_CLAIM:
+		if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+		return foolcache_claim(fcc, p);
+
+	case FOOLCACHE_PUBLISH:
+		if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+		return foolcache_publish(fcc, p);
+
+	case FOOLCACHE_GETBITMAP:
+		return foolcache_getbitmap(fcc, p);
+
+	case FOOLCACHE_GETTRACE:
+		return foolcache_gettrace(fcc, p);
+
+	case FOOLCACHE_PREWARM:
+		if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+		return foolcache_prewarm(fcc, p);
+
+	default:
+		return -ENOTTY;
+	}
+}
+/*
+static int foolcache_merge(struct dm_target *ti, struct bvec_merge_data *bvm,
+			struct bio_vec *biovec, int max_size)
+{
+	struct foolcache_c *fcc = ti->private;
+	struct request_queue *q = bdev_get_queue(fcc->dev->bdev);
+
+	if (!q->merge_bvec_fn)
+		return max_size;
+
+	bvm->bi_bdev = fcc->dev->bdev;
+	bvm->bi_sector = linear_map_sector(ti, bvm->bi_sector);
+
+	return min(max_size, q->merge_bvec_fn(q, bvm, biovec));
+}
+*/
+static int foolcache_iterate_devices(struct dm_target *ti,
+				  iterate_devices_callout_fn fn, void *data)
+{
+	int r;
+	struct foolcache_c *fcc = ti->private;
+	r = fn(ti, fcc->origin, 0, fcc->sectors, data);
+	if (r) return r;
+	r = fn(ti, fcc->cache, 0, fcc->sectors, data);
+	if (r || fcc->meta == fcc->cache) return r;
+	r = fn(ti, fcc->meta, 0, 1 + fcc->bitmap_sectors + fcc->trace_sectors, data);
+	return r;
+}
+
+static int foolcache_map(struct dm_target *ti, struct bio *bio,
+		      union map_info *map_context)
+{
+	struct foolcache_c *fcc = ti->private;
+	return map_async(fcc, bio, map_context);
+}
+
+static int foolcache_end_io(struct dm_target *ti, struct bio *bio,
+		      int error, union map_info *map_context)
+{
+	struct foolcache_c *fcc = ti->private;
+	return fc_end_io(fcc, map_context->ptr, error);
+}
+
+static struct target_type foolcache_target = {
+	.name   = "foolcache",
+	.version = {1, 0, 0},
+	.module = THIS_MODULE,
+	.ctr    = foolcache_ctr,
+	.dtr    = foolcache_dtr,
+	.map    = foolcache_map,
+	.end_io = foolcache_end_io,
+	.postsuspend = foolcache_postsuspend,
+	.preresume = foolcache_preresume,
+	.resume = foolcache_resume,
+	.status = foolcache_status,
+	.message = foolcache_message,
+	.ioctl  = foolcache_ioctl,
+//	.merge  = foolcache_merge,
+	.iterate_devices = foolcache_iterate_devices,
+};
+
+static inline void print_percent(struct seq_file *m, const char* title, 
+	unsigned long a, unsigned long b)
+{
+	unsigned int x = b ? a*100/b : 0;
+	unsigned int y = b ? (a*1000/b)%10 : 0;
+	seq_printf(m, "%s: %lu/%lu (%u.%u%%)\n", title, a, b, x, y);
+}
+
+static void foolcache_proc_show_sched(struct seq_file* m, struct fc_sched* s)
+{
+	int i;
+	static const char* names[FC_IO_CLASSES] = {"miss", "readahead", "hydrate"};
+	seq_printf(m, "Scheduler: %s, %u/%u copies in flight\n", 
+		s->policy == FC_SCHED_STRICT ? "strict" : "weighted", 
+		s->inflight, s->max_inflight);
+	for (i=0; i<FC_IO_CLASSES; ++i)
+	{
+		struct fc_class* c = &s->classes[i];
+		seq_printf(m, "  %s: queued %u, inflight %u/%u, weight %u, "
+			"iops %u, bandwidth %uKB/s, dispatched %llu\n", names[i], 
+			c->queued, c->inflight, c->max_inflight, c->weight, 
+			c->iops, c->bandwidth, (unsigned long long)c->dispatched);
+	}
+}
+
+// upper bound, in us, of the bucket where the given fraction (in 1/1000) falls
+static u64 hist_percentile(u64* hist, u64 count, unsigned int permille)
+{
+	int i;
+	u64 sum = 0, target = div64_u64(count * permille + 999, 1000);
+	for (i=0; i<FC_HIST_BUCKETS; ++i)
+	{
+		sum += hist[i];
+		if (sum >= target) break;
+	}
+	return i ? 1ULL << i : 1;
+}
+
+static void foolcache_proc_show_latency(struct seq_file* m, struct foolcache_c* fcc)
+{
+	int i, j;
+	u64 hist[FC_HIST_BUCKETS], count, total;
+	seq_printf(m, "Bytes copied: %llu\n", 
+		(unsigned long long)fc_stats_sum(fcc, bytes_copied));
+	seq_printf(m, "Metadata writes: %llu (%llu bytes)\n", 
+		(unsigned long long)fc_stats_sum(fcc, meta_writes), 
+		(unsigned long long)fc_stats_sum(fcc, meta_bytes));
+	seq_puts(m, "Latency (us): count, avg, p50<, p99<, p999<\n");
+	for (i=0; i<FC_PATHS; ++i)
+	{
+		total = fc_stats_hist(fcc, i, hist);
+		for (j=count=0; j<FC_HIST_BUCKETS; ++j)
+		{
+			count += hist[j];
+		}
+		if (count == 0) continue;
+		seq_printf(m, "  %s: %llu, %llu, %llu, %llu, %llu\n", fc_path_names[i], 
+			(unsigned long long)count, 
+			(unsigned long long)div64_u64(total, count),
+			(unsigned long long)hist_percentile(hist, count, 500),
+			(unsigned long long)hist_percentile(hist, count, 990),
+			(unsigned long long)hist_percentile(hist, count, 999));
+	}
+}
+
+static int foolcache_proc_show(struct seq_file* m, void* v)
+{
+	unsigned long hits;
+	struct foolcache_c *fcc = m->private;
+	// seq_puts(m, "Foolcache\n");
+	seq_printf(m, "Bypassing: %u\n", fcc->bypassing);
+	seq_printf(m, "Origin: %s\n", fcc->origin->name);
+	seq_printf(m, "Cache: %s\n", fcc->cache->name);
+	seq_printf(m, "Metadata: %s\n", fcc->meta->name);
+	seq_printf(m, "BlockSize: %uKB\n", fcc->block_size*512/1024);
+	if (fcc->subblock_shift)
+	{
+		seq_printf(m, "SubBlockSize: %uKB, %u blocks partly cached\n", 
+			(1 << fcc->subblock_shift)*512/1024, fcc->partial_blocks);
+	}
+	if (fcc->shared)
+	{
+		seq_printf(m, "Shared: %u targets, %llu origin reads, %llu joined, %lluKB kept\n",
+			fcc->shared->users, (unsigned long long)fcc->shared->reads,
+			(unsigned long long)fcc->shared->joined, 
+			(unsigned long long)fcc->shared->kept*512/1024);
+	}
+	seq_printf(m, "Last Timedout at: %lu\n", atomic64_read(&fcc->ts));
+	seq_printf(m, "Kcopyd jobs: %u\n", atomic_read(&fcc->kcopyd_jobs));
+	seq_printf(m, "Claims: %u\n", fcc->nr_claims);
+	seq_printf(m, "Trace: %u blocks%s, %u sectors on metadata\n",
+		fcc->trace ? min_t(unsigned int, atomic_read(&fcc->trace_len), 
+			fcc->trace_cap) : 0,
+		fcc->recording ? ", recording" : "", fcc->trace_sectors);
+	seq_printf(m, "Prewarm: %llu/%llu blocks\n",
+		(unsigned long long)atomic64_read(&fcc->prewarm_done),
+		(unsigned long long)atomic64_read(&fcc->prewarm_total));
+	seq_printf(m, "Errors: copy %llu, cache read %llu, %u blocks in backoff\n",
+		(unsigned long long)atomic64_read(&fcc->copy_errors),
+		(unsigned long long)atomic64_read(&fcc->read_errors),
+		fcc->error_blocks);
+	hits = atomic64_read(&fcc->hits);
+	print_percent(m, "Hit", hits, hits + atomic64_read(&fcc->misses));
+	print_percent(m, "Fullfillment", atomic64_read(&fcc->cached_blocks), fcc->blocks);
+	foolcache_proc_show_sched(m, &fcc->sched);
+	foolcache_proc_show_latency(m, fcc);
+	return 0;
+}
+
+static int foolcache_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, foolcache_proc_show, PDE(inode)->data);
+}
+
+static const struct file_operations foolcache_proc_fops = {
+	.open		= foolcache_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+// named after the origin, or after the cache for targets sharing their origin
+static inline const char* proc_name(struct foolcache_c* fcc)
+{
+	return fcc->shared ? fcc->cache->name : fcc->origin->name;
+}
+
+static inline void proc_new_entry(struct foolcache_c* fcc)
+{
+// proc_create_data(const char *name, umode_t mode,
+// 					struct proc_dir_entry *parent,
+// 					const struct file_operations *proc_fops,
+// 					void *data)
+	proc_create_data(proc_name(fcc), 
+		S_IRUGO, fcdir_proc, &foolcache_proc_fops, fcc);
+}
+
+static inline void proc_remove_entry(struct foolcache_c* fcc)
+{
+	remove_proc_entry(proc_name(fcc), fcdir_proc);
+}
+
+int __init dm_foolcache_init(void)
+{
+	int r;
+	fc_io_cache = KMEM_CACHE(fc_io, 0);
+	if (fc_io_cache == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	r = dm_register_target(&foolcache_target);
+	if (r < 0)
+	{
+		DMERR("register failed %d", r);
+		kmem_cache_destroy(fc_io_cache);
+		return r;
+	}
+
+	fcdir_proc = proc_mkdir("foolcache", NULL);
+
+	return r;
+}
+
+void dm_foolcache_exit(void)
+{
+	dm_unregister_target(&foolcache_target);
+	remove_proc_entry("foolcache", NULL);
+	kmem_cache_destroy(fc_io_cache);
+}
+
+/* Module hooks */
+module_init(dm_foolcache_init);
+module_exit(dm_foolcache_exit);
+
+MODULE_DESCRIPTION(DM_NAME " foolcache target");
+MODULE_AUTHOR("Huiba Li <lihuiba@gmail.com>");
+MODULE_LICENSE("GPL");
+
@@ -0,0 +1,228 @@
+/*
+ * Tracepoints of dm-foolcache.
+ *
+ * This file is released under the GPL.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM foolcache
+
+#if !defined(_TRACE_FOOLCACHE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_FOOLCACHE_H
+
+#include <linux/tracepoint.h>
+
+#define FC_MAP_HIT	0
+#define FC_MAP_MISS	1
+#define FC_MAP_BYPASS	2
+
+#define show_map_decision(d)					\
+	__print_symbolic(d,					\
+		{ FC_MAP_HIT,		"hit" },		\
+		{ FC_MAP_MISS,		"miss" },		\
+		{ FC_MAP_BYPASS,	"bypass" })
+
+#define show_io_class(c)					\
+	__print_symbolic(c,					\
+		{ 0,	"miss" },				\
+		{ 1,	"readahead" },				\
+		{ 2,	"hydrate" })
+
+TRACE_EVENT(foolcache_map,
+
+	TP_PROTO(dev_t dev, sector_t sector, unsigned int size, int decision),
+
+	TP_ARGS(dev, sector, size, decision),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(sector_t,	sector)
+		__field(unsigned int,	size)
+		__field(int,		decision)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->sector		= sector;
+		__entry->size		= size;
+		__entry->decision	= decision;
+	),
+
+	TP_printk("%d,%d sector=%llu size=%u %s",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		(unsigned long long)__entry->sector, __entry->size,
+		show_map_decision(__entry->decision))
+);
+
+DECLARE_EVENT_CLASS(foolcache_copy,
+
+	TP_PROTO(dev_t dev, unsigned long block, sector_t sector,
+		unsigned int count, unsigned int cls, int error),
+
+	TP_ARGS(dev, block, sector, count, cls, error),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	block)
+		__field(sector_t,	sector)
+		__field(unsigned int,	count)
+		__field(unsigned int,	cls)
+		__field(int,		error)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->block		= block;
+		__entry->sector		= sector;
+		__entry->count		= count;
+		__entry->cls		= cls;
+		__entry->error		= error;
+	),
+
+	TP_printk("%d,%d block=%lu sectors=[%llu, %llu] class=%s error=%d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->block,
+		(unsigned long long)__entry->sector,
+		(unsigned long long)__entry->sector + __entry->count - 1,
+		show_io_class(__entry->cls), __entry->error)
+);
+
+DEFINE_EVENT(foolcache_copy, foolcache_copy_start,
+	TP_PROTO(dev_t dev, unsigned long block, sector_t sector,
+		unsigned int count, unsigned int cls, int error),
+	TP_ARGS(dev, block, sector, count, cls, error)
+);
+
+DEFINE_EVENT(foolcache_copy, foolcache_copy_end,
+	TP_PROTO(dev_t dev, unsigned long block, sector_t sector,
+		unsigned int count, unsigned int cls, int error),
+	TP_ARGS(dev, block, sector, count, cls, error)
+);
+
+DECLARE_EVENT_CLASS(foolcache_wait,
+
+	TP_PROTO(dev_t dev, unsigned long block),
+
+	TP_ARGS(dev, block),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	block)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->block		= block;
+	),
+
+	TP_printk("%d,%d block=%lu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->block)
+);
+
+DEFINE_EVENT(foolcache_wait, foolcache_wait_start,
+	TP_PROTO(dev_t dev, unsigned long block),
+	TP_ARGS(dev, block)
+);
+
+DEFINE_EVENT(foolcache_wait, foolcache_wait_end,
+	TP_PROTO(dev_t dev, unsigned long block),
+	TP_ARGS(dev, block)
+);
+
+TRACE_EVENT(foolcache_defer,
+
+	TP_PROTO(dev_t dev, unsigned long block, unsigned int cls,
+		unsigned int queued, unsigned int inflight),
+
+	TP_ARGS(dev, block, cls, queued, inflight),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	block)
+		__field(unsigned int,	cls)
+		__field(unsigned int,	queued)
+		__field(unsigned int,	inflight)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->block		= block;
+		__entry->cls		= cls;
+		__entry->queued		= queued;
+		__entry->inflight	= inflight;
+	),
+
+	TP_printk("%d,%d block=%lu class=%s queued=%u inflight=%u",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->block,
+		show_io_class(__entry->cls), __entry->queued, __entry->inflight)
+);
+
+TRACE_EVENT(foolcache_flush_start,
+
+	TP_PROTO(dev_t dev, sector_t sector, unsigned int count),
+
+	TP_ARGS(dev, sector, count),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(sector_t,	sector)
+		__field(unsigned int,	count)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->sector		= sector;
+		__entry->count		= count;
+	),
+
+	TP_printk("%d,%d sector=%llu count=%u",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		(unsigned long long)__entry->sector, __entry->count)
+);
+
+TRACE_EVENT(foolcache_flush_end,
+
+	TP_PROTO(dev_t dev, unsigned long error),
+
+	TP_ARGS(dev, error),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	error)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->error		= error;
+	),
+
+	TP_printk("%d,%d error=%lu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->error)
+);
+
+TRACE_EVENT(foolcache_bypass,
+
+	TP_PROTO(dev_t dev, unsigned int bypassing),
+
+	TP_ARGS(dev, bypassing),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned int,	bypassing)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->bypassing	= bypassing;
+	),
+
+	TP_printk("%d,%d bypassing=%u",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->bypassing)
+);
+
+#endif /* _TRACE_FOOLCACHE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dm-foolcache-trace
+#include <trace/define_trace.h>
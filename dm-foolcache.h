@@ -0,0 +1,421 @@
+/*
+ * State shared by the foolcache target and its caching core.
+ *
+ * The core, dm-foolcache-core.c, builds both in the kernel and in userspace,
+ * where bench/ provides a mock of the block layer.
+ *
+ * This file is released under the GPL.
+ */
+
+#ifndef _DM_FOOLCACHE_H
+#define _DM_FOOLCACHE_H
+
+#ifdef __KERNEL__
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/device-mapper.h>
+#include <linux/dm-kcopyd.h>
+#include <linux/dm-io.h>
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/delay.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/mempool.h>
+#include <linux/hash.h>
+#ifndef READ_ONCE			// before 3.19
+#define READ_ONCE(x)		ACCESS_ONCE(x)
+#define WRITE_ONCE(x, v)	(ACCESS_ONCE(x) = (v))
+#endif
+#else
+#include "kernel.h"
+#endif
+
+#include "ioctl.h"
+
+#define DM_MSG_PREFIX "foolcache"
+
+struct header;
+
+/*
+ * Every copy from the origin goes through a per-target scheduler. Copies are
+ * classified so that foreground misses never queue behind bulk copies.
+ */
+enum fc_io_class {
+	FC_IO_MISS,			// foreground read miss, a bio is waiting
+	FC_IO_READAHEAD,		// blocks following a miss
+	FC_IO_HYDRATE,			// background hydration
+	FC_IO_CLASSES
+};
+
+enum fc_sched_policy {
+	FC_SCHED_STRICT,		// always serve the lowest class first
+	FC_SCHED_WEIGHTED,		// share by weight (stride scheduling)
+};
+
+#define FC_MAX_COPY_JOBS	100
+#define FC_SCHED_STRIDE		(1<<16)
+
+struct fc_class {
+	struct list_head queue;
+	unsigned int queued, inflight;
+	unsigned int max_inflight;	// 0 for no per-class limit
+	unsigned int weight;		// share under FC_SCHED_WEIGHTED
+	unsigned int iops;		// copies per second, 0 for unlimited
+	unsigned int bandwidth;		// KB per second, 0 for unlimited
+	s64 iops_tokens, bw_tokens;	// token buckets, scaled by HZ
+	u64 pass;
+	u64 dispatched;
+};
+
+struct fc_sched {
+	spinlock_t lock;
+	struct fc_class classes[FC_IO_CLASSES];
+	unsigned int policy;
+	unsigned int max_inflight, inflight;
+	unsigned long last_refill;
+	u64 vtime;
+	struct timer_list timer;
+	struct work_struct work;
+	struct list_head stopped;		// background jobs, over a suspend
+};
+
+/*
+ * Latency of every bio is accounted, in log2 buckets of microseconds, to the
+ * path it took. Bucket i holds latencies in [2^(i-1), 2^i) us.
+ */
+enum fc_path {
+	FC_PATH_HIT,			// remapped to cache
+	FC_PATH_MISS,			// copied from origin, then read from cache
+	FC_PATH_WAIT,			// waited for a copy issued by someone else
+	FC_PATH_BYPASS,			// remapped to origin
+	FC_PATH_FLUSH,			// bitmap write
+	FC_PATHS
+};
+
+#define FC_HIST_BUCKETS 32
+
+struct fc_stats {
+	u64 hist[FC_PATHS][FC_HIST_BUCKETS];
+	u64 total_us[FC_PATHS];
+	u64 bytes_copied;
+	u64 meta_writes, meta_bytes;
+};
+
+// per-bio context, hung on map_context->ptr
+struct fc_io {
+	ktime_t start;
+	unsigned int path;
+	unsigned int from_cache, retried;
+	struct bio* bio;
+	struct list_head list;
+	sector_t sector;			// saved for retrying from origin
+	unsigned int size;
+	unsigned short idx;
+};
+
+/*
+ * Blocks that failed to copy are retried with an exponential backoff, their
+ * reads are served from origin in the meantime. Only when errors pile up in
+ * a window the whole target bypasses the cache, and it recovers after a while.
+ */
+#define FC_ERROR_HASH_BITS	6
+#define FC_MAX_ERROR_BLOCKS	1024
+#define FC_BACKOFF_MIN		(1*HZ)
+#define FC_BACKOFF_MAX		(300*HZ)
+
+struct fc_error {
+	struct list_head list;
+	unsigned long block;
+	unsigned int count;
+	unsigned long retry_at;
+};
+
+/*
+ * Copies complete on a per-cpu, high priority workqueue, on the cpu that
+ * issued them, where the next step of each job is taken in batches. Jobs
+ * waiting for a block copied by someone else are parked in a hash, and are
+ * queued there again when the copy ends.
+ */
+#define FC_WAIT_HASH_BITS	8
+
+struct fc_done {
+	spinlock_t lock;
+	struct list_head jobs;
+	struct work_struct work;
+	struct foolcache_c* fcc;
+};
+
+struct fc_waitq {
+	spinlock_t lock;
+	struct list_head jobs;
+};
+
+/*
+ * Blocks handed over to a userspace replicator, which copies them itself.
+ * They stay marked as being copied until published or the lease expires.
+ */
+#define FC_MAX_CLAIMS		FOOLCACHE_CLAIMS_MAX
+#define FC_CLAIM_LEASE		(30*HZ)
+
+struct fc_claim {
+	struct list_head list;
+	unsigned long start, count;
+	unsigned long expires;
+	bool ready;			// handed out, until then only its claimer frees it
+	unsigned long bits[0];
+};
+
+/*
+ * The first access of every block can be logged, in order, to be replayed
+ * later through the copy engine, before the blocks are read again.
+ */
+#define FC_TRACE_MAX_BLOCKS	(1<<20)
+
+struct fc_replay {
+	u32* blocks;
+	unsigned long count;
+	atomic_t next;				// index of the next block to copy
+	atomic_t lanes;				// jobs walking the log
+};
+
+/*
+ * With sub-blocks, a miss copies only the sub-blocks it reads. Blocks partly
+ * copied keep their valid sub-blocks in memory, until the block is complete
+ * and set in the bitmap. Past max_partial_blocks, the least recently used
+ * block that is not being copied is forgotten, and copied again later.
+ */
+#define FC_PARTIAL_HASH_BITS	12
+#define FC_MAX_PARTIAL_BLOCKS	(1<<16)
+
+struct fc_partial {
+	struct list_head list;
+	struct list_head lru;			// least recently used first
+	unsigned long block;
+	unsigned long bits[0];
+};
+
+/*
+ * Targets with the `shared` option and the same origin fetch each range of
+ * it once: a copy joins the fetch of the same range in flight, whose data is
+ * written to the cache of every target that joined. Fetches done may be kept
+ * for a while, up to shared_cache_kb (a module parameter) per origin.
+ */
+#define FC_FETCH_HASH_BITS	8
+#define FC_FETCH_MAX_PAGES	256		// larger copies go through kcopyd
+
+struct fc_origin;
+
+struct fc_fetch {
+	struct list_head hash;
+	struct list_head lru;			// when kept
+	struct fc_origin* origin;
+	sector_t sector, count;
+	int error;
+	unsigned int done;			// read from origin
+	atomic_t refs;				// the hash and every writer
+	struct list_head jobs;			// waiting for the read
+	struct work_struct work;
+	unsigned int nr_pages;
+	struct page_list pages[0];		// from the page pool of origin
+};
+
+struct fc_origin {
+	struct list_head list;
+	dev_t dev;
+	unsigned int users;			// targets
+	spinlock_t lock;
+	struct list_head fetches[1<<FC_FETCH_HASH_BITS];
+	struct list_head lru;			// fetches kept
+	sector_t kept;
+	u64 reads, joined;
+	struct workqueue_struct* wq;
+	struct dm_io_client* io_client;
+	mempool_t* page_pool;
+};
+
+extern unsigned int fc_shared_cache_kb;
+
+struct foolcache_c {
+	struct dm_dev* cache;
+	struct dm_dev* origin;
+	struct dm_dev* meta;			// cache, or a dedicated device
+	sector_t header_sector, bitmap_sector;	// on meta
+	struct dm_io_client* io_client;
+	unsigned int bypassing;
+	sector_t sectors, last_caching_sector;
+	unsigned long size, blocks;
+	unsigned int block_size;		// block (chunk) size, in sector
+	unsigned int block_shift;
+	unsigned int block_mask;
+	unsigned int subblock_shift;		// in sector, 0 without sub-blocks
+	unsigned int subblocks;			// per block
+	unsigned long* bitmap;
+	unsigned long* copying;
+	unsigned long bitmap_modified;
+	unsigned long bitmap_last_sync;
+	atomic_t bitmap_writes;			// asynchronous, in flight
+	struct header* header;
+	unsigned int bitmap_sectors;
+	struct workqueue_struct* done_wq;
+	struct fc_done __percpu* done;
+	struct fc_waitq waiters[1<<FC_WAIT_HASH_BITS];
+	atomic_t parked;			// jobs in waiters
+	struct timer_list wait_timer;		// re-checks parked jobs
+	struct work_struct wait_work;
+	struct dm_kcopyd_client* kcopyd_client;
+	atomic64_t cached_blocks, hits, misses, ts;
+	atomic_t kcopyd_jobs;
+	struct fc_sched sched;
+	unsigned int readahead;			// in blocks, 0 to disable
+	unsigned long flush_interval;		// in jiffies, 0 to disable
+	unsigned long wait_timeout;		// in jiffies
+	unsigned int suspended;
+	struct fc_stats __percpu* stats;
+	mempool_t* io_pool;
+	ktime_t flush_start;
+	spinlock_t error_lock;
+	struct list_head error_hash[1<<FC_ERROR_HASH_BITS];
+	unsigned int error_blocks;		// blocks in backoff
+	unsigned int window_errors;
+	unsigned long window_start;
+	unsigned int error_threshold;		// errors per window to bypass, 0 never
+	unsigned long error_window;		// in jiffies
+	unsigned long bypass_recover;		// in jiffies, 0 to bypass forever
+	unsigned long bypass_until;
+	atomic64_t copy_errors, read_errors;
+	struct list_head failed_reads;
+	struct work_struct retry_work;
+	spinlock_t claim_lock;
+	struct list_head claims;
+	unsigned int nr_claims;
+	atomic64_t generation;			// of the bitmap
+	u64* region_gen;			// per FOOLCACHE_REGION_BLOCKS blocks
+	u32* trace;				// blocks in first-access order
+	unsigned int trace_cap;
+	atomic_t trace_len;
+	unsigned long* accessed;		// blocks in the trace
+	unsigned int recording, trace_dirty;
+	sector_t trace_sector;			// on meta
+	unsigned int trace_sectors;		// 0 without a trace region
+	bool record, prewarm;			// table options
+	u32* prewarm_log;			// replayed on activation
+	unsigned long prewarm_count;
+	atomic64_t prewarm_done, prewarm_total;
+	struct fc_origin* shared;		// NULL unless shared
+	struct list_head live_list;		// in fc_live_targets, once resumed
+	bool takeover;				// reloaded over a live target
+	bool retired;				// taken over, its metadata not its own
+	spinlock_t partial_lock;
+	struct list_head partial_hash[1<<FC_PARTIAL_HASH_BITS];
+	struct list_head partial_lru;
+	unsigned int partial_blocks, max_partial_blocks;
+};
+
+/*
+ * A job either serves a bio (a miss), or, with a NULL bio, copies a range of
+ * blocks in the background (readahead / hydration), or the blocks of a
+ * replayed log.
+ */
+struct job_kcopyd {
+	struct bio* bio;
+	struct foolcache_c* fcc;
+	struct fc_io* io;
+	struct fc_replay* replay;
+	struct fc_fetch* fetch;			// of a shared copy
+	struct list_head list;
+	unsigned int cls, stride;
+	int cpu;				// completes on
+	bool parked;				// completing a wait, not a copy
+	int error;
+	unsigned long copying_block, end_block;
+	struct dm_io_region origin, cache;
+};
+
+static inline dev_t fc_dev(struct foolcache_c* fcc)
+{
+	return fcc->cache->bdev->bd_dev;
+}
+
+static inline unsigned long sector2block(struct foolcache_c* fcc, sector_t sector)
+{
+	return sector >> fcc->block_shift;
+}
+
+static inline sector_t block2sector(struct foolcache_c* fcc, unsigned long block)
+{
+	return block << fcc->block_shift;
+}
+
+static inline unsigned long last_caching_block(struct foolcache_c* fcc)
+{
+	return sector2block(fcc, fcc->last_caching_sector);
+}
+
+#define fc_stats_sum(fcc, field) ({				\
+	int __cpu;							\
+	u64 __sum = 0;							\
+	for_each_possible_cpu(__cpu)					\
+		__sum += per_cpu_ptr((fcc)->stats, __cpu)->field;	\
+	__sum;								\
+})
+
+// to be called after a bit of the bitmap is set or cleared
+static inline void bitmap_changed(struct foolcache_c* fcc, unsigned long block)
+{
+	u64 old, gen, *p = &fcc->region_gen[block / FOOLCACHE_REGION_BLOCKS];
+	WRITE_ONCE(fcc->bitmap_modified, 1);
+	smp_wmb();
+	gen = atomic64_inc_return(&fcc->generation);
+	// only raised, writers of a region may get there out of order
+	for (old = READ_ONCE(*p); old < gen; old = READ_ONCE(*p))
+	{
+		if (cmpxchg64(p, old, gen) == old) break;
+	}
+}
+
+void wake_waiters(struct foolcache_c* fcc, unsigned long block);
+
+static inline void end_copying(struct foolcache_c* fcc, unsigned long block)
+{
+	smp_mb__before_clear_bit();
+	clear_bit(block, fcc->copying);
+	smp_mb__after_clear_bit();
+	if (atomic_read(&fcc->parked)) wake_waiters(fcc, block);
+}
+
+/* dm-foolcache-core.c */
+int fc_core_init(struct foolcache_c* fcc);
+void fc_core_exit(struct foolcache_c* fcc);
+int map_async(struct foolcache_c* fcc, struct bio* bio, 
+	union map_info* map_context);
+int fc_end_io(struct foolcache_c* fcc, struct fc_io* io, int error);
+u64 fc_stats_hist(struct foolcache_c* fcc, unsigned int path, u64* hist);
+int write_bitmap(struct foolcache_c* fcc, io_notify_fn callback);
+void wait_bitmap(struct foolcache_c* fcc);
+void expire_claims(struct foolcache_c* fcc, bool all);
+void leave_bypass(struct foolcache_c* fcc);
+void block_recovered(struct foolcache_c* fcc, unsigned long block);
+void drop_partial(struct foolcache_c* fcc, unsigned long block);
+int invalidate_blocks(struct foolcache_c* fcc, 
+	unsigned long start, unsigned long end);
+int hydrate_blocks(struct foolcache_c* fcc, unsigned long start, 
+	unsigned long end, unsigned int cls);
+int prewarm_blocks(struct foolcache_c* fcc, u32* blocks, unsigned long count);
+void fc_sched_dispatch(struct foolcache_c* fcc);
+void fc_sched_quiesce(struct foolcache_c* fcc);
+void fc_sched_resume(struct foolcache_c* fcc);
+void fc_copy_ended(struct job_kcopyd* job, int error);
+
+/* dm-foolcache-shared.c */
+struct fc_origin* fc_shared_get(struct block_device* bdev);
+void fc_shared_put(struct fc_origin* o);
+int fc_shared_copy(struct job_kcopyd* job);
+void fc_fetch_put(struct fc_fetch* f);
+
+#endif /* _DM_FOOLCACHE_H */
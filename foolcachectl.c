@@ -1,11 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <linux/fs.h>
 #include <linux/fiemap.h>
 #include "ioctl.h"
 
@@ -17,42 +23,37 @@ struct foolcache {
 	unsigned int blocksize;
 };
 
-void replicate(int fd)
-{
-
-}
-
-foolcache* foolcache_ctor(const char* path)
+struct foolcache* foolcache_ctor(const char* path)
 {
 	int ret;
-	foolcache* fc;
-	struct stat stat;
+	struct foolcache* fc;
+	uint64_t size;
 	fc = malloc(sizeof(*fc));
 	if (fc==NULL) return NULL;
 
-	fcc->fd = open(path, "rb");
-	if (fcc->fd==-1)
+	fc->fd = open(path, O_RDONLY);
+	if (fc->fd==-1)
 	{
 		error = "open failed";
 		goto out1;
 	}
 
-	ret = fstat(fd, &stat);
-	if (ret) 
+	ret = ioctl(fc->fd, BLKGETSIZE64, &size);
+	if (ret==-1)
 	{
-		error = "fstat failed"
+		error = "BLKGETSIZE64 failed";
 		goto out2;
 	}
-	fc->size = stat.st_size;
+	fc->size = size;
 
-	ret = ioctl(fd, FOOLCACHE_GETBSZ, &fc->blocksize);
+	ret = ioctl(fc->fd, FOOLCACHE_GETBSZ, &fc->blocksize);
 	if (ret==-1)
 	{
 		error = strerror(errno);
 		goto out2;
 	}
-	fc->blocks = fc->size / fc->blocksize;
-	
+	fc->blocks = (fc->size + fc->blocksize - 1) / fc->blocksize;
+
 	return fc;
 
 
@@ -63,63 +64,478 @@ out1:
 	return NULL;
 }
 
+void foolcache_dtor(struct foolcache* fc)
+{
+	close(fc->fd);
+	free(fc);
+}
+
 int foolcache_fibmap(struct foolcache* fc, int block)
 {
-	int ret = ioctl(fd, FOOLCACHE_FIBMAP, &block);
+	int ret = ioctl(fc->fd, FOOLCACHE_FIBMAP, &block);
 	if (ret==-1) return -1;
 	return block;
 }
 
-int main(int argc, char** argv)
+// residency of all blocks, one bit per block, in a single call
+unsigned char* foolcache_bitmap(struct foolcache* fc, uint64_t* generation)
 {
-	char* error;
-	int fd, ret, blocksize=0, i, block;
-	struct fiemap fiemap;
-	struct fiemap* fmap;
+	struct foolcache_bitmap q;
+	unsigned char* bitmap = calloc((fc->blocks + 7) / 8, 1);
+	if (bitmap==NULL)
+	{
+		error = "out of memory";
+		return NULL;
+	}
+
+	memset(&q, 0, sizeof(q));
+	q.count = fc->blocks;
+	q.bitmap = (uintptr_t)bitmap;
+	if (ioctl(fc->fd, FOOLCACHE_GETBITMAP, &q)==-1)
+	{
+		error = strerror(errno);
+		free(bitmap);
+		return NULL;
+	}
+	if (generation) *generation = q.generation;
+	return bitmap;
+}
+
+/*
+ * The replicator copies blocks from origin to cache with O_DIRECT, one
+ * claim of up to FOOLCACHE_CLAIM_MAX blocks per thread at a time, and
+ * publishes each claim once it is copied. Foreground misses wait for claimed
+ * blocks, and a claim is released after its 30 second lease, so claims start
+ * at REPLICATE_CLAIM_SIZE and are halved whenever one takes longer than
+ * REPLICATE_CLAIM_SECONDS; a claim still copying at REPLICATE_DEADLINE is
+ * published as far as it got. A claim refused while others are outstanding
+ * is retried until one is released, at the latest by its lease.
+ */
+#define REPLICATE_IO_SIZE (1024*1024)
+#define REPLICATE_CLAIM_SIZE (8*1024*1024)
+#define REPLICATE_CLAIM_SECONDS 5
+#define REPLICATE_DEADLINE 20
+#define REPLICATE_LEASE 30
+
+struct replicator {
 	struct foolcache* fc;
-	fc = foolcache_ctor(argv[1]);
-	if (fc==NULL)
+	int origin, cache;
+	unsigned int claim_blocks;
+	unsigned char* bitmap;		// residency when replication started
+	pthread_mutex_t mutex;
+	uint64_t next_block, copied, failed;
+	int stop;
+};
+
+static int copy_block(struct replicator* rp, void* buf, uint64_t block)
+{
+	off_t offset = (off_t)block * rp->fc->blocksize;
+	off_t end = offset + rp->fc->blocksize;
+	ssize_t n;
+	if (end > (off_t)rp->fc->size) end = rp->fc->size;
+	while (offset < end)
 	{
-		puts(error);
+		size_t len = end - offset;
+		if (len > REPLICATE_IO_SIZE) len = REPLICATE_IO_SIZE;
+		n = pread(rp->origin, buf, len, offset);
+		if (n != (ssize_t)len) return -1;
+		n = pwrite(rp->cache, buf, len, offset);
+		if (n != (ssize_t)len) return -1;
+		offset += len;
+	}
+	return 0;
+}
+
+static int all_cached(struct replicator* rp, uint64_t start, unsigned int count)
+{
+	uint64_t block, end = start + count;
+	if (end > rp->fc->blocks) end = rp->fc->blocks;
+	for (block=start; block<end; ++block)
+	{
+		if (!(rp->bitmap[block/8] & (1<<(block%8)))) return 0;
+	}
+	return 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* replicate_thread(void* arg)
+{
+	struct replicator* rp = arg;
+	struct foolcache_range range;
+	unsigned char *claimed, *copied;
+	unsigned int i, n, count, bytes = (rp->claim_blocks + 7) / 8;
+	uint64_t start;
+	double t0, elapsed;
+	void* buf = NULL;
+	int r;
+
+	claimed = malloc(bytes);
+	copied = malloc(bytes);
+	if (claimed==NULL || copied==NULL ||
+		posix_memalign(&buf, 4096, REPLICATE_IO_SIZE))
+	{
+		fprintf(stderr, "out of memory\n");
+		rp->stop = 1;
+		goto out;
+	}
+
+	while (1)
+	{
+		pthread_mutex_lock(&rp->mutex);
+		start = rp->next_block;
+		count = rp->claim_blocks;
+		rp->next_block += count;
+		pthread_mutex_unlock(&rp->mutex);
+		if (rp->stop || start >= rp->fc->blocks) break;
+		if (all_cached(rp, start, count)) continue;
+
+		memset(claimed, 0, bytes);
+		range.start = start;
+		range.count = count;
+		range.bitmap = (uintptr_t)claimed;
+		t0 = now();
+		while ((r = ioctl(rp->fc->fd, FOOLCACHE_CLAIM, &range))==-1 &&
+			errno == EBUSY && now() - t0 < REPLICATE_LEASE && !rp->stop)
+		{	// claims of others outstanding
+			usleep(100*1000);
+		}
+		if (r==-1)
+		{
+			if (errno == EINVAL) break;	// past the cacheable range
+			fprintf(stderr, "claim %llu failed: %s\n",
+				(unsigned long long)start, strerror(errno));
+			rp->stop = 1;
+			break;
+		}
+		if (range.claimed == 0) continue;
+
+		t0 = now();
+		memset(copied, 0, bytes);
+		for (i=n=0; i<range.count; ++i)
+		{
+			if (!(claimed[i/8] & (1<<(i%8)))) continue;
+			if (now() - t0 > REPLICATE_DEADLINE || 
+				copy_block(rp, buf, start + i) != 0)
+			{	// late or failed, left to the kernel
+				__sync_fetch_and_add(&rp->failed, 1);
+				continue;
+			}
+			copied[i/8] |= 1<<(i%8);
+			n++;
+		}
+		elapsed = now() - t0;
+		if (elapsed > REPLICATE_CLAIM_SECONDS && count > 1)
+		{	// too slow for the lease, claim less
+			pthread_mutex_lock(&rp->mutex);
+			if (rp->claim_blocks > count / 2) rp->claim_blocks = count / 2;
+			pthread_mutex_unlock(&rp->mutex);
+		}
+
+		range.bitmap = (uintptr_t)copied;
+		if (ioctl(rp->fc->fd, FOOLCACHE_PUBLISH, &range)==-1)
+		{
+			fprintf(stderr, "publish %llu failed: %s\n",
+				(unsigned long long)start, strerror(errno));
+			__sync_fetch_and_add(&rp->failed, n);
+			continue;
+		}
+		__sync_fetch_and_add(&rp->copied, range.claimed);
+	}
+
+out:
+	free(buf);
+	free(copied);
+	free(claimed);
+	return NULL;
+}
+
+int replicate(struct foolcache* fc, const char* origin, const char* cache,
+	int threads)
+{
+	int i, ret = -1;
+	pthread_t* tids;
+	struct replicator rp;
+
+	memset(&rp, 0, sizeof(rp));
+	rp.fc = fc;
+	rp.claim_blocks = FOOLCACHE_CLAIM_MAX;
+	if (rp.claim_blocks * (uint64_t)fc->blocksize > REPLICATE_CLAIM_SIZE)
+	{	// keep claims small, the kernel waits for claimed blocks
+		rp.claim_blocks = REPLICATE_CLAIM_SIZE / fc->blocksize;
+		if (rp.claim_blocks == 0) rp.claim_blocks = 1;
+	}
+	if (threads > FOOLCACHE_CLAIMS_MAX)
+	{	// one claim each, the kernel refuses more
+		threads = FOOLCACHE_CLAIMS_MAX;
+	}
+	pthread_mutex_init(&rp.mutex, NULL);
+	rp.bitmap = foolcache_bitmap(fc, NULL);
+	if (rp.bitmap==NULL) return -1;
+
+	rp.origin = open(origin, O_RDONLY | O_DIRECT);
+	rp.cache = open(cache, O_WRONLY | O_DIRECT);
+	tids = calloc(threads, sizeof(*tids));
+	if (rp.origin==-1 || rp.cache==-1 || tids==NULL)
+	{
+		error = tids==NULL ? "out of memory" : "open failed";
+		goto out;
+	}
+
+	for (i=0; i<threads; ++i)
+	{
+		if (pthread_create(&tids[i], NULL, replicate_thread, &rp)) break;
+	}
+	if (i == 0)
+	{
+		error = "cannot create threads";
+		goto out;
+	}
+	while (i--)
+	{
+		pthread_join(tids[i], NULL);
+	}
+
+	printf("Replicated %llu blocks, %llu failed\n",
+		(unsigned long long)rp.copied, (unsigned long long)rp.failed);
+	if (rp.stop || rp.failed)
+		error = "replication incomplete";
+	else
+		ret = 0;
+
+out:
+	free(tids);
+	free(rp.bitmap);
+	if (rp.origin!=-1) close(rp.origin);
+	if (rp.cache!=-1) close(rp.cache);
+	return ret;
+}
+
+/*
+ * A trace file is a header followed by the __u32 block numbers of the trace.
+ * A trace only applies to caches of the same image and block size.
+ */
+static const char TRACE_MAGIC[8] = "FCTRACE1";
+
+struct trace_file {
+	char magic[8];
+	uint32_t block_size;		// in bytes
+	uint32_t count;
+};
+
+int trace_save(struct foolcache* fc, const char* path)
+{
+	struct foolcache_trace q;
+	struct trace_file h;
+	uint32_t* blocks;
+	uint64_t count;
+	FILE* f;
+
+	memset(&q, 0, sizeof(q));
+	if (ioctl(fc->fd, FOOLCACHE_GETTRACE, &q)==-1)
+	{
+		error = strerror(errno);
+		return -1;
+	}
+	count = q.count;
+	blocks = calloc(count + 1, sizeof(uint32_t));
+	if (blocks==NULL)
+	{
+		error = "out of memory";
+		return -1;
+	}
+	q.blocks = (uintptr_t)blocks;
+	if (ioctl(fc->fd, FOOLCACHE_GETTRACE, &q)==-1)
+	{
+		error = strerror(errno);
+		free(blocks);
+		return -1;
+	}
+
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.block_size = fc->blocksize;
+	h.count = q.count < count ? q.count : count;	// it may have grown
+	f = fopen(path, "wb");
+	if (f==NULL || fwrite(&h, sizeof(h), 1, f)!=1 ||
+		fwrite(blocks, sizeof(uint32_t), h.count, f)!=h.count)
+	{
+		error = "cannot write the trace file";
+		if (f) fclose(f);
+		free(blocks);
+		return -1;
+	}
+	fclose(f);
+	free(blocks);
+	printf("Saved %u blocks\n", h.count);
+	return 0;
+}
+
+int prewarm(struct foolcache* fc, const char* path)
+{
+	struct foolcache_trace q;
+	struct trace_file h;
+	uint32_t* blocks;
+	FILE* f = fopen(path, "rb");
+
+	if (f==NULL || fread(&h, sizeof(h), 1, f)!=1 ||
+		memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic))!=0)
+	{
+		error = "not a trace file";
+		if (f) fclose(f);
+		return -1;
+	}
+	if (h.block_size != fc->blocksize)
+	{
+		error = "the trace was recorded with another block size";
+		fclose(f);
 		return -1;
 	}
+	blocks = calloc(h.count + 1, sizeof(uint32_t));
+	if (blocks==NULL || fread(blocks, sizeof(uint32_t), h.count, f)!=h.count)
+	{
+		error = "cannot read the trace file";
+		free(blocks);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	q.count = h.count;
+	q.blocks = (uintptr_t)blocks;
+	if (h.count && ioctl(fc->fd, FOOLCACHE_PREWARM, &q)==-1)
+	{
+		error = strerror(errno);
+		free(blocks);
+		return -1;
+	}
+	free(blocks);
+	printf("Prewarming %u blocks\n", h.count);
+	return 0;
+}
+
+int info(struct foolcache* fc)
+{
+	int ret, i;
+	size_t block, cached = 0;
+	uint64_t generation;
+	unsigned char* bitmap;
+	struct fiemap fiemap;
+	struct fiemap* fmap;
 
 	printf("Block Size: %dKB\n", fc->blocksize/1024);
 
-	for (i=0; 1; ++i)
+	bitmap = foolcache_bitmap(fc, &generation);
+	if (bitmap==NULL) return -1;
+	for (block=0; block<fc->blocks; ++block)
 	{
-		block = i;
-		ret = ioctl(fd, FOOLCACHE_FIBMAP, &block);
-		if (ret==-1) break;
-		printf("%u", block);
+		int bit = (bitmap[block/8] >> (block%8)) & 1;
+		cached += bit;
+		printf("%u", bit);
 	}
 	printf("\n");
+	printf("Cached: %zu/%zu blocks (generation %llu)\n",
+		cached, fc->blocks, (unsigned long long)generation);
+	free(bitmap);
 
+	memset(&fiemap, 0, sizeof(fiemap));
 	fiemap.fm_start = 0;
 	fiemap.fm_length = 1024*1024*1024;
 	fiemap.fm_extent_count = 0;
-	ret = ioctl(fd, FOOLCACHE_FIEMAP, &fiemap);
+	ret = ioctl(fc->fd, FOOLCACHE_FIEMAP, &fiemap);
+	if (ret==-1)
+	{
+		error = strerror(errno);
+		return -1;
+	}
 	printf("fm_mapped_extents=%u\n", fiemap.fm_mapped_extents);
 
-	fmap = malloc(sizeof(struct fiemap) + 
+	fmap = calloc(1, sizeof(struct fiemap) +
 		fiemap.fm_mapped_extents * sizeof(struct fiemap_extent));
 	fmap->fm_start = fiemap.fm_start;
 	fmap->fm_length = fiemap.fm_length;
 	fmap->fm_extent_count = fiemap.fm_mapped_extents;
-	ret = ioctl(fd, FOOLCACHE_FIEMAP, fmap);
+	ret = ioctl(fc->fd, FOOLCACHE_FIEMAP, fmap);
 	printf("fm_mapped_extents=%u\n", fmap->fm_mapped_extents);
 
 	for (i=0; i<fmap->fm_mapped_extents; ++i)
 	{
 		struct fiemap_extent* e = &fmap->fm_extents[i];
-		printf("%lu: [%lu, %lu]\n", 
+		printf("%lu: [%lu, %lu]\n",
 			(unsigned long)(e->fe_logical/e->fe_length),
 			(unsigned long)e->fe_logical,
 			(unsigned long)(e->fe_logical + e->fe_length - 1));
 	}
 
 	free(fmap);
-	close(fd);
 	return 0;
 }
 
+static void usage(void)
+{
+	puts("usage: foolcachectl <foolcache dev>\n"
+	     "       foolcachectl replicate <foolcache dev> <origin> <cache> [threads]\n"
+	     "       foolcachectl trace-save <foolcache dev> <file>\n"
+	     "       foolcachectl prewarm <foolcache dev> <file>");
+}
+
+int main(int argc, char** argv)
+{
+	int ret, threads = 16;
+	struct foolcache* fc;
+	const char *cmd, *dev;
+
+	if (argc<2)
+	{
+		usage();
+		return -1;
+	}
+	cmd = argv[1];
+	dev = argc>2 ? argv[2] : NULL;
+	if (strcmp(cmd, "replicate")!=0 && strcmp(cmd, "trace-save")!=0 &&
+		strcmp(cmd, "prewarm")!=0)
+	{
+		cmd = "info";
+		dev = argv[1];
+	}
+	if (dev==NULL || (strcmp(cmd, "replicate")==0 && argc<5) ||
+		(strcmp(cmd, "info")!=0 && strcmp(cmd, "replicate")!=0 && argc<4))
+	{
+		usage();
+		return -1;
+	}
+
+	fc = foolcache_ctor(dev);
+	if (fc==NULL)
+	{
+		puts(error);
+		return -1;
+	}
+
+	if (strcmp(cmd, "replicate")==0)
+	{
+		if (argc>=6) threads = atoi(argv[5]);
+		if (threads<=0) threads = 1;
+		ret = replicate(fc, argv[3], argv[4], threads);
+	}
+	else if (strcmp(cmd, "trace-save")==0)
+	{
+		ret = trace_save(fc, argv[3]);
+	}
+	else if (strcmp(cmd, "prewarm")==0)
+	{
+		ret = prewarm(fc, argv[3]);
+	}
+	else
+	{
+		ret = info(fc);
+	}
+
+	if (ret) puts(error);
+	foolcache_dtor(fc);
+	return ret;
+}
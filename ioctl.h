@@ -1,8 +1,83 @@
 #ifndef __FOOLCACHE_IOCTL_
 #define __FOOLCACHE_IOCTL_
 
+#include <linux/types.h>
+
 #define FOOLCACHE_GETBSZ 0xfc01
 #define FOOLCACHE_FIBMAP 0xfc02
 #define FOOLCACHE_FIEMAP 0xfc03
+#define FOOLCACHE_CLAIM 0xfc04
+#define FOOLCACHE_PUBLISH 0xfc05
+#define FOOLCACHE_GETBITMAP 0xfc06
+#define FOOLCACHE_GETTRACE 0xfc07
+#define FOOLCACHE_PREWARM 0xfc08
+
+#define FOOLCACHE_CLAIM_MAX 4096	// blocks per claim
+#define FOOLCACHE_CLAIMS_MAX 64		// claims outstanding
+
+/*
+ * Blocks [start, start+count), with a bitmap of (count+7)/8 bytes where
+ * block start+i is bit i%8 of byte i/8.
+ *
+ * FOOLCACHE_CLAIM hands the uncached blocks of the range, that nobody else
+ * is copying, over to the caller: they are set in bitmap, and the kernel 
+ * will wait for them instead of copying them itself. count is clipped to 
+ * the cacheable range, and claimed returns the number of blocks handed over.
+ *
+ * Once the claimed blocks are copied from origin to cache, FOOLCACHE_PUBLISH
+ * with the same start and count marks the blocks set in bitmap as cached,
+ * and releases the rest of the claim. claimed returns the number of blocks
+ * published. Claims not published within 30 seconds are released. A claim
+ * fails with EBUSY while FOOLCACHE_CLAIMS_MAX are outstanding, or one with
+ * the same start.
+ * Both need CAP_SYS_ADMIN.
+ */
+struct foolcache_range {
+	__u64 start;
+	__u32 count;
+	__u32 claimed;
+	__u64 bitmap;			// user pointer
+};
+
+/*
+ * FOOLCACHE_GETBITMAP copies the residency bits of blocks [start, start+count)
+ * to bitmap in a single call, with the layout above; start must be a multiple
+ * of 8, and count is clipped to the number of blocks. generation returns a 
+ * counter that is bumped on every change of the bitmap, read before copying.
+ *
+ * With since set to a generation returned earlier, only the regions of
+ * FOOLCACHE_REGION_BLOCKS blocks that changed after it are copied, and the
+ * rest of the buffer is left as is: passing the buffer of the previous call
+ * keeps it up to date. changed returns the number of regions copied.
+ * Generations start from the wall clock, in ns, whenever the table is loaded,
+ * so a since of an earlier instance gets every region; one greater than the
+ * current generation gets the whole bitmap as well.
+ */
+#define FOOLCACHE_REGION_BLOCKS 32768
+
+struct foolcache_bitmap {
+	__u64 start;
+	__u64 count;
+	__u64 since;
+	__u64 generation;
+	__u64 changed;
+	__u64 bitmap;			// user pointer
+};
+
+/*
+ * An access trace is the list of blocks in the order they were first read,
+ * each block once, as __u32 block numbers.
+ *
+ * FOOLCACHE_GETTRACE copies up to count entries of the trace recorded by the
+ * target to blocks, and returns the length of the trace in count. 
+ *
+ * FOOLCACHE_PREWARM copies the count blocks of a trace from origin to cache,
+ * in the background and in order, skipping the blocks already cached. It
+ * needs CAP_SYS_ADMIN.
+ */
+struct foolcache_trace {
+	__u64 count;
+	__u64 blocks;			// user pointer
+};
 
 #endif